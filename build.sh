@@ -1,3 +1,7 @@
 #!/bin/sh
 set -e -x
-cc -Wall -pedantic -std=c11 -O3 -g -o um-32 um-32.c
+cc -Wall -pedantic -std=c11 -O3 -g -pthread -c um-32.c um-32-lz.c um-32-snapshot.c um-32-io.c um-32-host.c um-32-bench.c um-32-pipe.c um-32-migrate.c um-32-sibling.c um-32-lockstep.c um-32-cold.c um-32-edges.c um-32-fuzz.c
+ar rcs libum-32.a um-32.o um-32-lz.o um-32-snapshot.o um-32-io.o um-32-host.o um-32-bench.o um-32-pipe.o um-32-migrate.o um-32-sibling.o um-32-lockstep.o um-32-cold.o um-32-edges.o um-32-fuzz.o
+cc -Wall -pedantic -std=c11 -O3 -g -pthread -o um-32 um-32-main.c libum-32.a
+cc -Wall -pedantic -std=c11 -O3 -g -o um-32-opt um-32-opt.c
+cc -Wall -pedantic -std=c11 -O3 -g -o um-32-sample um-32-sample.c
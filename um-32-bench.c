@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+// Throughput scaling benchmark: for k = 1..N, run k copies of a program
+// side by side, each pinned to its own core, and see how far aggregate
+// MIPS falls short of k times the single-instance figure. Machines share
+// nothing but the allocator and the memory system, so any shortfall is
+// one of those; the LLC counters say which.
+
+typedef struct BenchResult {
+    uint64_t icount;
+    double seconds;
+    uint64_t llc_refs;
+    uint64_t llc_misses;
+    bool counters;          // LLC counters were available
+    bool failed;            // the machine Failed
+} BenchResult;
+
+typedef struct BenchInstance {
+    Buffer prog;
+    uint64_t limit;
+    uint32_t compact_ratio;
+    int cpu;
+    pthread_barrier_t *start;   // threads: released together by this...
+    int ready_fd;               // ...processes: report ready, then wait
+    int go_fd;                  // for a byte on go_fd
+    pthread_t thread;
+    BenchResult result;
+} BenchInstance;
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Counts this thread only, user space only, so unprivileged runs work
+// under the default perf_event_paranoid setting.
+static int bench_open_counter(uint64_t config)
+{
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t bench_read_counter(int fd)
+{
+    uint64_t v = 0;
+    if (read(fd, &v, sizeof(v)) != sizeof(v)) {
+        return 0;
+    }
+    return v;
+}
+
+static void bench_instance(BenchInstance *bi)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(bi->cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+
+    // Output is dropped and input is at EOF: only the machine is measured.
+    Machine vm = {0};
+    MemIo mem = {0};
+    um_32_init(&vm, bi->prog);
+    um_32_io_memory(&vm.io, &mem);
+    if (bi->compact_ratio) {
+        vm.compact_ratio = bi->compact_ratio;
+        vm.compact_at = COMPACT_MIN_HELD;
+    }
+
+    int refs = bench_open_counter(PERF_COUNT_HW_CACHE_REFERENCES);
+    int misses = bench_open_counter(PERF_COUNT_HW_CACHE_MISSES);
+    BenchResult *res = &bi->result;
+    res->counters = refs >= 0 && misses >= 0;
+
+    if (bi->start) {
+        pthread_barrier_wait(bi->start);
+    } else {
+        char c = 0;
+        if (write(bi->ready_fd, &c, 1) != 1 || read(bi->go_fd, &c, 1) != 1) {
+            res->failed = true;
+        }
+    }
+    if (res->counters) {
+        ioctl(refs, PERF_EVENT_IOC_ENABLE, 0);
+        ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    // A process of its own can be sampled like any other.
+    if (!bi->start) {
+        um_32_descriptor.vm = &vm;
+    }
+    double t0 = bench_now();
+    RunStatus status = um_32_run(&vm, bi->limit ? bi->limit : UINT64_MAX);
+    res->seconds = bench_now() - t0;
+    um_32_descriptor.vm = NULL;
+    if (res->counters) {
+        ioctl(refs, PERF_EVENT_IOC_DISABLE, 0);
+        ioctl(misses, PERF_EVENT_IOC_DISABLE, 0);
+        res->llc_refs = bench_read_counter(refs);
+        res->llc_misses = bench_read_counter(misses);
+    }
+    if (refs >= 0) {
+        close(refs);
+    }
+    if (misses >= 0) {
+        close(misses);
+    }
+    res->icount = vm.icount;
+    res->failed |= status == RUN_FAILED || status == RUN_BLOCKED;
+    um_32_shutdown(&vm);
+    um_32_io_close(&vm.io);
+}
+
+static void *bench_thread_main(void *arg)
+{
+    bench_instance(arg);
+    return NULL;
+}
+
+// Runs k instances as threads; returns the wall time from the common start
+// to the last one finishing.
+static double bench_threads(BenchInstance *bis, int k)
+{
+    um_32_descriptor.many = 1;
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, k + 1);
+    for (int i = 0; i < k; i++) {
+        bis[i].start = &start;
+        if (pthread_create(&bis[i].thread, NULL, bench_thread_main, &bis[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&start);
+    double t0 = bench_now();
+    for (int i = 0; i < k; i++) {
+        pthread_join(bis[i].thread, NULL);
+    }
+    double wall = bench_now() - t0;
+    pthread_barrier_destroy(&start);
+    return wall;
+}
+
+// Same, as forked processes: no shared heap at all, which tells allocator
+// contention apart from memory-system contention.
+static double bench_processes(BenchInstance *bis, int k)
+{
+    int ready[2], go[2], results[2];
+    if (pipe(ready) < 0 || pipe(go) < 0 || pipe(results) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    for (int i = 0; i < k; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            bis[i].start = NULL;
+            bis[i].ready_fd = ready[1];
+            bis[i].go_fd = go[0];
+            bench_instance(&bis[i]);
+            // One result per write is well under PIPE_BUF, so they don't interleave.
+            struct { int i; BenchResult r; } msg = {i, bis[i].result};
+            ssize_t w = write(results[1], &msg, sizeof(msg));
+            _exit(w == sizeof(msg) ? 0 : 1);
+        }
+    }
+    char c;
+    for (int i = 0; i < k; i++) {
+        if (read(ready[0], &c, 1) != 1) {
+            perror("waiting for instances");
+            exit(1);
+        }
+    }
+    double t0 = bench_now();
+    for (int i = 0; i < k; i++) {
+        if (write(go[1], &c, 1) != 1) {
+            perror("starting instances");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < k; i++) {
+        struct { int i; BenchResult r; } msg;
+        if (read(results[0], &msg, sizeof(msg)) != sizeof(msg)) {
+            perror("collecting results");
+            exit(1);
+        }
+        bis[msg.i].result = msg.r;
+    }
+    double wall = bench_now() - t0;
+    while (wait(NULL) > 0) {
+    }
+    close(ready[0]);
+    close(ready[1]);
+    close(go[0]);
+    close(go[1]);
+    close(results[0]);
+    close(results[1]);
+    return wall;
+}
+
+int um_32_bench(Buffer prog, int max_instances, bool processes, uint64_t limit,
+                uint32_t compact_ratio)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        return 1;
+    }
+    int ncpus = CPU_COUNT(&allowed);
+    int *cpus = xcalloc(ncpus, sizeof(int));
+    for (int c = 0, n = 0; n < ncpus; c++) {
+        if (CPU_ISSET(c, &allowed)) {
+            cpus[n++] = c;
+        }
+    }
+    if (max_instances > ncpus) {
+        fprintf(stderr, "** %d instances on %d cpus: beyond %d they share cores.\n",
+                max_instances, ncpus, ncpus);
+    }
+
+    BenchInstance *bis = xcalloc(max_instances, sizeof(BenchInstance));
+    printf("%s, %s", processes ? "processes" : "threads",
+            limit ? "instruction limit per instance" : "run to halt");
+    if (compact_ratio) {
+        printf(", compacting at %ux", compact_ratio);
+    }
+    printf("\n");
+    printf("%5s %9s %10s %18s %7s %9s %9s %10s\n",
+            "inst", "wall(s)", "agg MIPS", "MIPS/inst min-max",
+            "effic", "LLC miss%", "LLC MPKI", "LLC MB/s");
+    double base_mips = 0;
+    int status = 0;
+    for (int k = 1; k <= max_instances; k++) {
+        for (int i = 0; i < k; i++) {
+            bis[i] = (BenchInstance){0};
+            bis[i].prog = prog;
+            bis[i].limit = limit;
+            bis[i].compact_ratio = compact_ratio;
+            bis[i].cpu = cpus[i % ncpus];
+        }
+        double wall = processes ? bench_processes(bis, k) : bench_threads(bis, k);
+
+        uint64_t icount = 0, refs = 0, misses = 0;
+        double lo = 0, hi = 0;
+        bool counters = true, failed = false;
+        for (int i = 0; i < k; i++) {
+            BenchResult *r = &bis[i].result;
+            double mips = r->seconds > 0 ? r->icount / r->seconds / 1e6 : 0;
+            lo = i == 0 || mips < lo ? mips : lo;
+            hi = i == 0 || mips > hi ? mips : hi;
+            icount += r->icount;
+            refs += r->llc_refs;
+            misses += r->llc_misses;
+            counters &= r->counters;
+            failed |= r->failed;
+        }
+        double mips = icount / wall / 1e6;
+        if (k == 1) {
+            base_mips = mips;
+        }
+        char range[32];
+        snprintf(range, sizeof(range), "%.0f-%.0f", lo, hi);
+        printf("%5d %9.2f %10.1f %18s %6.1f%%", k, wall, mips, range,
+                base_mips > 0 ? 100 * mips / (k * base_mips) : 0);
+        if (counters) {
+            // Every LLC miss is one cache line from DRAM.
+            printf(" %8.1f%% %9.3f %10.1f",
+                    refs ? 100.0 * misses / refs : 0,
+                    icount ? 1000.0 * misses / icount : 0,
+                    misses * 64.0 / wall / 1e6);
+        } else {
+            printf(" %9s %9s %10s", "n/a", "n/a", "n/a");
+        }
+        printf("%s\n", failed ? "  (an instance Failed)" : "");
+        if (failed) {
+            status = 1;
+        }
+    }
+    free(bis);
+    free(cpus);
+    return status;
+}
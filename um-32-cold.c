@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+#include <time.h>
+
+// Cold arrays. Every so often a sweep (um_32_chill) goes over a machine's
+// large arrays. One it finds warm it only watches: the array is marked
+// inactive, contents untouched, so the next ARRAY_INDEX, ARRAY_AMEND,
+// ABANDON or LOAD_PROG on it takes the interpreter's existing slow path,
+// where um_32_warm puts it back. One still watched at the next sweep has
+// gone a whole interval without a touch, and is compressed in place; the
+// slow path then decompresses it. The fast path pays nothing for any of
+// this, as it already checks `active`.
+//
+// A watched array that holds nothing but values below 256 is stored as
+// bytes instead, a quarter of the size. It stays inactive, and the slow
+// paths of ARRAY_INDEX and ARRAY_AMEND read and write the bytes in place
+// (um_32_bytes_index, um_32_bytes_amend); the first amendment of a value
+// that does not fit widens it back, as does anything else that needs the
+// platters. A byte array left untouched for another interval is
+// compressed in turn, as bytes. One that was touched stays bytes, and
+// keeps being served by the slow paths, unless it was used as often as
+// it has platters: then it is widened at the sweep, and gets its fast
+// path back.
+//
+// Only arrays with a chunk of their own are considered, since those are
+// the ones that give their memory back when freed, and ALLOC keeps a list
+// of them so a sweep needn't walk every identifier ever handed out. The
+// bytes and the compressed copy (preceded by its length) are the things a
+// machine keeps outside its region: they are mostly small enough that the
+// region would carve them from a shared chunk, and never give them back
+// when the array is warmed again.
+
+enum {
+    COLD_WARM,
+    COLD_WATCHED,   // inactive only to catch the next touch
+    COLD_PACKED,    // `inst` points at the compressed copy
+    COLD_BYTES,     // `inst` points at one byte per platter
+    COLD_BYTES_USED,        // the same, touched since the last sweep
+    COLD_BYTES_PACKED,      // the compressed copy of the bytes
+};
+
+// An array has to compress at least this well to be worth packing.
+#define COLD_MIN_RATIO 2
+
+// Uses of a byte array per platter, in an interval, that make it worth
+// widening.
+#define COLD_HOT_USES 1
+
+static double cold_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Compresses the `raw` bytes array `idx` takes, in the region or (as
+// bytes) out of it.
+static bool cold_pack(Machine *vm, uint32_t idx, size_t raw)
+{
+    Mem *m = &vm->M[idx];
+    size_t cap = raw / COLD_MIN_RATIO;
+    uint8_t *tmp = xmalloc(lz_compress_bound(raw));
+    size_t comp = lz_compress((const uint8_t *)m->inst, raw, tmp, cap);
+    if (comp) {
+        size_t *blob = xmalloc(sizeof(size_t) + comp);
+        blob[0] = comp;
+        memcpy(blob + 1, tmp, comp);
+        if (vm->cold->state[idx] == COLD_BYTES) {
+            free(m->inst);
+        } else {
+            region_free(&vm->region, m->inst, raw);
+        }
+        m->inst = (uint32_t *)blob;
+        vm->cold_stats.packed++;
+        vm->cold_stats.raw += raw;
+        vm->cold_stats.comp += comp;
+    }
+    free(tmp);
+    return comp != 0;
+}
+
+// The inverse of cold_pack, into the `raw` bytes at `data`.
+static void cold_unpack(Machine *vm, uint32_t idx, void *data, size_t raw)
+{
+    Mem *m = &vm->M[idx];
+    size_t *blob = (size_t *)m->inst;
+    size_t comp = blob[0];
+    if (!lz_decompress((const uint8_t *)(blob + 1), comp, data, raw)) {
+        fprintf(stderr, "** cold array %u does not decompress\n", idx);
+        abort();
+    }
+    free(blob);
+    vm->cold_stats.warmed++;
+    vm->cold_stats.raw -= raw;
+    vm->cold_stats.comp -= comp;
+    m->inst = data;
+}
+
+// Stores array `idx` as bytes if none of its platters needs more.
+static bool cold_narrow(Machine *vm, uint32_t idx)
+{
+    Mem *m = &vm->M[idx];
+    uint32_t wide = 0;
+    for (size_t i = 0; i < m->len; i++) {
+        wide |= m->inst[i];
+    }
+    if (wide > 0xff) {
+        return false;
+    }
+    uint8_t *bytes = xmalloc(m->len);
+    for (size_t i = 0; i < m->len; i++) {
+        bytes[i] = m->inst[i];
+    }
+    region_free(&vm->region, m->inst, m->len * 4);
+    m->inst = (uint32_t *)bytes;
+    vm->cold->uses[idx] = 0;
+    vm->cold_stats.narrowed++;
+    return true;
+}
+
+// The inverse of cold_narrow.
+static void cold_widen(Machine *vm, uint32_t idx)
+{
+    Mem *m = &vm->M[idx];
+    uint8_t *bytes = (uint8_t *)m->inst;
+    uint32_t *inst = region_alloc(&vm->region, m->len * 4);
+    for (size_t i = 0; i < m->len; i++) {
+        inst[i] = bytes[i];
+    }
+    free(bytes);
+    m->inst = inst;
+    vm->cold_stats.widened++;
+}
+
+void um_32_chill(Machine *vm)
+{
+    double t0 = cold_now();
+    Cold *c = vm->cold;
+    uint32_t kept = 0;
+    for (uint32_t k = 0; k < c->nlarge; k++) {
+        uint32_t i = c->large[k];
+        Mem *m = &vm->M[i];
+        switch (c->state[i]) {
+            case COLD_WARM:
+                if (!m->active) {
+                    continue;   // abandoned: off the list
+                }
+                m->active = false;
+                c->state[i] = COLD_WATCHED;
+                break;
+            case COLD_WATCHED:
+                if (cold_narrow(vm, i)) {
+                    c->state[i] = COLD_BYTES;
+                } else if (cold_pack(vm, i, m->len * 4)) {
+                    c->state[i] = COLD_PACKED;
+                } else {
+                    // Left warm, and tried again two sweeps from now.
+                    m->active = true;
+                    c->state[i] = COLD_WARM;
+                }
+                break;
+            case COLD_BYTES:
+                if (cold_pack(vm, i, m->len)) {
+                    c->state[i] = COLD_BYTES_PACKED;
+                }
+                break;
+            case COLD_BYTES_USED:
+                if (c->uses[i] / COLD_HOT_USES >= m->len) {
+                    cold_widen(vm, i);
+                    m->active = true;
+                    c->state[i] = COLD_WARM;
+                } else {
+                    c->state[i] = COLD_BYTES;
+                }
+                c->uses[i] = 0;
+                break;
+        }
+        c->large[kept++] = i;
+    }
+    c->nlarge = kept;
+    vm->cold_stats.sweeps++;
+    vm->cold_stats.seconds += cold_now() - t0;
+}
+
+// Makes array `idx` usable again if a sweep took it; false if it is not
+// (or no longer) an array at all.
+bool um_32_warm(Machine *vm, uint32_t idx)
+{
+    Cold *c = vm->cold;
+    if (!c || idx >= vm->memarr_count || c->state[idx] == COLD_WARM) {
+        return false;
+    }
+    Mem *m = &vm->M[idx];
+    double t0 = cold_now();
+    switch (c->state[idx]) {
+        case COLD_PACKED:
+            cold_unpack(vm, idx, region_alloc(&vm->region, m->len * 4), m->len * 4);
+            break;
+        case COLD_BYTES_PACKED:
+            cold_unpack(vm, idx, xmalloc(m->len), m->len);
+            // fall through
+        case COLD_BYTES:
+        case COLD_BYTES_USED:
+            cold_widen(vm, idx);
+            break;
+    }
+    vm->cold_stats.seconds += cold_now() - t0;
+    m->active = true;
+    c->state[idx] = COLD_WARM;
+    return true;
+}
+
+// The bytes of array `idx`, if it is stored as bytes; NULL otherwise.
+static uint8_t *cold_bytes(Machine *vm, uint32_t idx)
+{
+    Cold *c = vm->cold;
+    if (idx >= vm->memarr_count) {
+        return NULL;
+    }
+    switch (c->state[idx]) {
+        case COLD_BYTES_PACKED:
+            {
+                double t0 = cold_now();
+                cold_unpack(vm, idx, xmalloc(vm->M[idx].len), vm->M[idx].len);
+                vm->cold_stats.seconds += cold_now() - t0;
+            }
+            // fall through
+        case COLD_BYTES:
+            c->state[idx] = COLD_BYTES_USED;
+            // fall through
+        case COLD_BYTES_USED:
+            if (c->uses[idx] != UINT32_MAX) {
+                c->uses[idx]++;
+            }
+            return (uint8_t *)vm->M[idx].inst;
+    }
+    return NULL;
+}
+
+// ARRAY_INDEX on an array stored as bytes: false if it is not one, or
+// `off` is past its end.
+bool um_32_bytes_index(Machine *vm, uint32_t idx, uint32_t off, uint32_t *val)
+{
+    uint8_t *bytes = cold_bytes(vm, idx);
+    if (!bytes || off >= vm->M[idx].len) {
+        return false;
+    }
+    *val = bytes[off];
+    return true;
+}
+
+// ARRAY_AMEND on an array stored as bytes: false if it is not one, or
+// `val` does not fit (and the array has to be widened by um_32_warm).
+bool um_32_bytes_amend(Machine *vm, uint32_t idx, uint32_t off, uint32_t val)
+{
+    if (val > 0xff) {
+        return false;
+    }
+    uint8_t *bytes = cold_bytes(vm, idx);
+    if (!bytes || off >= vm->M[idx].len) {
+        return false;
+    }
+    bytes[off] = val;
+    return true;
+}
+
+// What array `idx` holds in the region, if a sweep took it; 0 otherwise.
+size_t um_32_cold_size(Machine *vm, uint32_t idx)
+{
+    if (!vm->cold) {
+        return 0;
+    }
+    switch (vm->cold->state[idx]) {
+        case COLD_WATCHED:
+            return vm->M[idx].len * 4;
+    }
+    return 0;
+}
+
+// Whether a sweep took array `idx` out of the region altogether.
+bool um_32_cold_apart(Machine *vm, uint32_t idx)
+{
+    return vm->cold && vm->cold->state[idx] != COLD_WARM &&
+           vm->cold->state[idx] != COLD_WATCHED;
+}
+
+void um_32_warm_all(Machine *vm)
+{
+    for (uint32_t k = 0; vm->cold && k < vm->cold->nlarge; k++) {
+        um_32_warm(vm, vm->cold->large[k]);
+    }
+}
+
+void um_32_cold_track(Machine *vm, uint32_t idx)
+{
+    Cold *c = vm->cold;
+    if (c->nlarge == c->large_cap) {
+        c->large_cap = c->large_cap ? c->large_cap * 2 : 64;
+        c->large = xrealloc(c->large, sizeof(uint32_t) * c->large_cap);
+    }
+    c->large[c->nlarge++] = idx;
+}
+
+// Starts sweeping a machine, taking in whatever large arrays it already
+// has (say, from a snapshot).
+void um_32_cold_start(Machine *vm)
+{
+    if (vm->cold) {
+        return;
+    }
+    vm->cold = xcalloc(1, sizeof(Cold));
+    vm->cold->state = xcalloc(vm->memarr_cap, 1);
+    vm->cold->uses = xmalloc(sizeof(uint32_t) * vm->memarr_cap);
+    for (uint32_t i = 1; i < vm->memarr_count; i++) {
+        if (vm->M[i].active && vm->M[i].len * 4 > REGION_LARGE_SIZE) {
+            um_32_cold_track(vm, i);
+        }
+    }
+}
+
+// Drops the sweep state and whatever it holds outside the region; while
+// the arrays are still there to say what that is.
+void um_32_cold_free(Machine *vm)
+{
+    if (vm->cold) {
+        for (uint32_t k = 0; k < vm->cold->nlarge; k++) {
+            uint32_t i = vm->cold->large[k];
+            if (um_32_cold_apart(vm, i)) {
+                free(vm->M[i].inst);
+            }
+        }
+        free(vm->cold->state);
+        free(vm->cold->uses);
+        free(vm->cold->large);
+        free(vm->cold);
+        vm->cold = NULL;
+    }
+}
+
+// Warms everything and stops sweeping, for as long as something else
+// needs to see every array as it is.
+void um_32_cold_stop(Machine *vm)
+{
+    um_32_warm_all(vm);
+    um_32_cold_free(vm);
+}
+
+void um_32_print_cold(const ColdStats *st)
+{
+    fprintf(stderr, "** %llu sweeps in %.3f s: %llu arrays compressed, %llu warmed again, "
+            "%.1f MiB cold in %.1f MiB; %llu stored as bytes, %llu widened again\n",
+            (unsigned long long)st->sweeps, st->seconds,
+            (unsigned long long)st->packed, (unsigned long long)st->warmed,
+            st->raw / (double)(1 << 20), st->comp / (double)(1 << 20),
+            (unsigned long long)st->narrowed, (unsigned long long)st->widened);
+}
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+
+// Edge profile: every LOAD_PROG counted as an edge from the finger it
+// was at to the one it set, in an open-addressed table keyed on the pair.
+// Jumps within array 0 and loads of a new program are kept apart. At the
+// end the edges become a weighted control-flow graph over the basic
+// blocks they imply (a block starts at 0 and at every jump target), in
+// Graphviz form, with a summary per jump site: how many targets it has
+// and how often it goes to its favourite one.
+//
+// Fingers are into whatever array 0 was at the time; a program that
+// loads others gets their edges merged by position.
+
+typedef struct Edge {
+    uint32_t from;
+    uint32_t to;
+    uint32_t load;      // 1: LOAD_PROG of a non-zero array
+    uint32_t used;
+    uint64_t count;
+} Edge;
+
+struct EdgeProfile {
+    Edge *slots;
+    size_t cap;         // a power of two
+    size_t n;
+    uint64_t transfers;
+    uint64_t loads;
+};
+
+#define EDGES_MIN_CAP 1024
+
+static inline size_t edge_hash(uint32_t from, uint32_t to, uint32_t load)
+{
+    uint64_t k = ((uint64_t)from << 32 | to) ^ load;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    return k;
+}
+
+static Edge *edge_slot(Edge *slots, size_t cap, uint32_t from, uint32_t to, uint32_t load)
+{
+    size_t i = edge_hash(from, to, load) & (cap - 1);
+    while (slots[i].used &&
+           (slots[i].from != from || slots[i].to != to || slots[i].load != load)) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &slots[i];
+}
+
+EdgeProfile *um_32_edges_new(void)
+{
+    EdgeProfile *p = xcalloc(1, sizeof(EdgeProfile));
+    p->cap = EDGES_MIN_CAP;
+    p->slots = xcalloc(p->cap, sizeof(Edge));
+    return p;
+}
+
+void um_32_edges_free(EdgeProfile *p)
+{
+    if (p) {
+        free(p->slots);
+        free(p);
+    }
+}
+
+static void edges_grow(EdgeProfile *p)
+{
+    size_t cap = p->cap * 2;
+    Edge *slots = xcalloc(cap, sizeof(Edge));
+    for (size_t i = 0; i < p->cap; i++) {
+        Edge *e = &p->slots[i];
+        if (e->used) {
+            *edge_slot(slots, cap, e->from, e->to, e->load) = *e;
+        }
+    }
+    free(p->slots);
+    p->slots = slots;
+    p->cap = cap;
+}
+
+void um_32_edge(EdgeProfile *p, uint32_t from, uint32_t to, bool load)
+{
+    Edge *e = edge_slot(p->slots, p->cap, from, to, load);
+    if (!e->used) {
+        if ((p->n + 1) * 2 > p->cap) {
+            edges_grow(p);
+            e = edge_slot(p->slots, p->cap, from, to, load);
+        }
+        *e = (Edge){from, to, load, 1, 0};
+        p->n++;
+    }
+    e->count++;
+    p->transfers++;
+    p->loads += load;
+}
+
+static int edge_by_site(const void *a, const void *b)
+{
+    const Edge *x = a, *y = b;
+    if (x->from != y->from) {
+        return x->from < y->from ? -1 : 1;
+    }
+    return x->count > y->count ? -1 : x->count < y->count;
+}
+
+static int u32_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// The start of the block holding `pc`.
+static uint32_t edge_block(const uint32_t *starts, size_t n, uint32_t pc)
+{
+    size_t lo = 0, hi = n;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (starts[mid] <= pc) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return starts[lo];
+}
+
+bool um_32_edges_write(EdgeProfile *p, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        return false;
+    }
+    Edge *edges = xmalloc(sizeof(Edge) * (p->n + 1));
+    uint32_t *starts = xmalloc(sizeof(uint32_t) * (p->n + 1));
+    size_t n = 0, nstarts = 0;
+    starts[nstarts++] = 0;
+    for (size_t i = 0; i < p->cap; i++) {
+        if (p->slots[i].used) {
+            edges[n++] = p->slots[i];
+            starts[nstarts++] = p->slots[i].to;
+        }
+    }
+    qsort(edges, n, sizeof(Edge), edge_by_site);
+    qsort(starts, nstarts, sizeof(uint32_t), u32_cmp);
+    size_t k = 0;
+    for (size_t i = 0; i < nstarts; i++) {
+        if (k == 0 || starts[i] != starts[k - 1]) {
+            starts[k++] = starts[i];
+        }
+    }
+    nstarts = k;
+
+    fprintf(f, "// um-32 edge profile: %llu transfers over %zu edges, %llu program loads\n",
+            (unsigned long long)p->transfers, n, (unsigned long long)p->loads);
+    fprintf(f, "// site: transfers, targets, share of the commonest target\n");
+    uint64_t mono = 0;
+    for (size_t i = 0; i < n; ) {
+        size_t j = i;
+        uint64_t total = 0;
+        while (j < n && edges[j].from == edges[i].from) {
+            total += edges[j++].count;
+        }
+        if (j - i == 1) {
+            mono += total;
+        }
+        fprintf(f, "// %u: %llu, %zu, %.1f%%\n", edges[i].from,
+                (unsigned long long)total, j - i, 100.0 * edges[i].count / total);
+        i = j;
+    }
+    fprintf(f, "digraph cfg {\n");
+    for (size_t i = 0; i < n; i++) {
+        Edge *e = &edges[i];
+        fprintf(f, "    b%u -> b%u [weight=%llu, label=\"%llu\"%s];\n",
+                edge_block(starts, nstarts, e->from), e->to,
+                (unsigned long long)e->count, (unsigned long long)e->count,
+                e->load ? ", style=dashed" : "");
+    }
+    fprintf(f, "}\n");
+    bool ok = fclose(f) == 0;
+
+    fprintf(stderr, "** %llu transfers over %zu edges between %zu blocks, "
+            "%.1f%% from single-target sites; CFG in %s\n",
+            (unsigned long long)p->transfers, n, nstarts,
+            p->transfers ? 100.0 * mono / p->transfers : 0, path);
+    free(edges);
+    free(starts);
+    return ok;
+}
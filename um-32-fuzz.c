@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+// Fuzzing guest input with AFL. Every LOAD_PROG bumps a byte in a 64 KiB
+// coverage map, indexed as AFL's own instrumentation does it: a hash of
+// where the finger landed, xored with half the hash of where it landed
+// the time before. The map is the fuzzer's shared memory segment, named
+// by __AFL_SHM_ID; without one it is a private segment, and the number of
+// bytes set is printed at the end, so a run over one input says how much
+// of the program it reached.
+//
+// The fork server sits in front of the console: the first time the
+// machine asks for input, everything up to there (booting, say) is done,
+// so the process forks once per execution from that point on, each child
+// reading its input from a fresh stdin. Without a fuzzer on the other end
+// of the control descriptors, the machine just goes on.
+
+#define FUZZ_MAP_SIZE (1 << 16)
+#define FORKSRV_FD 198      // control in; status out on the next one
+
+typedef struct FuzzIo {
+    IoBackend *inner;
+    Machine *vm;
+    bool started;
+} FuzzIo;
+
+void um_32_fuzz_start(Machine *vm)
+{
+    const char *id = getenv("__AFL_SHM_ID");
+    int shm = id ? atoi(id) : shmget(IPC_PRIVATE, FUZZ_MAP_SIZE, IPC_CREAT | 0600);
+    void *map = shm < 0 ? (void *)-1 : shmat(shm, NULL, 0);
+    if (map == (void *)-1) {
+        perror("attaching coverage map");
+        exit(1);
+    }
+    if (!id) {
+        // Gone as soon as it is detached.
+        shmctl(shm, IPC_RMID, NULL);
+    }
+    vm->cov = map;
+    vm->cov_prev = 0;
+}
+
+void um_32_fuzz_stop(Machine *vm)
+{
+    if (!vm->cov) {
+        return;
+    }
+    if (!getenv("__AFL_SHM_ID")) {
+        size_t hit = 0;
+        for (size_t i = 0; i < FUZZ_MAP_SIZE; i++) {
+            hit += vm->cov[i] != 0;
+        }
+        fprintf(stderr, "** %zu of %d coverage map entries hit\n", hit, FUZZ_MAP_SIZE);
+    }
+    shmdt(vm->cov);
+    vm->cov = NULL;
+}
+
+static bool fuzz_read_all(int fd, void *buf, size_t n)
+{
+    uint8_t *p = buf;
+    while (n) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+// Returns in the child of each execution; the fork server itself never
+// returns once a fuzzer has answered, and leaves when it hangs up.
+static void fuzz_fork_server(Machine *vm)
+{
+    uint32_t msg = 0;
+    if (write(FORKSRV_FD + 1, &msg, 4) != 4) {
+        return;     // nobody there
+    }
+    // Nothing but this thread may be running at a fork.
+    um_32_quiesce(vm);
+    for (;;) {
+        if (!fuzz_read_all(FORKSRV_FD, &msg, 4)) {
+            exit(0);
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork server");
+            exit(1);
+        }
+        if (pid == 0) {
+            close(FORKSRV_FD);
+            close(FORKSRV_FD + 1);
+            vm->cov_prev = 0;
+            return;
+        }
+        int status;
+        if (write(FORKSRV_FD + 1, &pid, 4) != 4 ||
+            waitpid(pid, &status, 0) < 0 ||
+            write(FORKSRV_FD + 1, &status, 4) != 4) {
+            exit(1);
+        }
+    }
+}
+
+static uint8_t *fuzz_out_span(void *ctx, size_t *cap)
+{
+    FuzzIo *io = ctx;
+    return io->inner->out_span(io->inner->ctx, cap);
+}
+
+static void fuzz_out_commit(void *ctx, size_t n)
+{
+    FuzzIo *io = ctx;
+    io->inner->out_commit(io->inner->ctx, n);
+}
+
+static int fuzz_in_span(void *ctx, const uint8_t **data, size_t *len)
+{
+    FuzzIo *io = ctx;
+    if (!io->started) {
+        io->started = true;
+        fuzz_fork_server(io->vm);
+    }
+    return io->inner->in_span(io->inner->ctx, data, len);
+}
+
+static void fuzz_in_consume(void *ctx, size_t n)
+{
+    FuzzIo *io = ctx;
+    io->inner->in_consume(io->inner->ctx, n);
+}
+
+// Closing the fuzzing backend leaves `inner` open. Output must already be
+// flushed when input is asked for, as um_32_run does it, or each child
+// would write what the server had left over.
+void um_32_io_fuzz(IoBackend *io, IoBackend *inner, Machine *vm)
+{
+    FuzzIo *fio = xcalloc(1, sizeof(FuzzIo));
+    fio->inner = inner;
+    fio->vm = vm;
+    *io = (IoBackend){0};
+    io->ctx = fio;
+    io->out_span = fuzz_out_span;
+    io->out_commit = fuzz_out_commit;
+    io->in_span = fuzz_in_span;
+    io->in_consume = fuzz_in_consume;
+    io->destroy = free;
+    io->line_flush = inner->line_flush;
+}
@@ -0,0 +1,979 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+// Multi-session host. Every connection to the listening socket gets its own
+// machine running the same program, and all of them are multiplexed on one
+// thread: runnable machines get an instruction quantum in turn, and their
+// console traffic is batched so that one io_uring_enter per round submits
+// every pending send and receive, whatever the number of sessions. Where
+// io_uring is unavailable the host falls back to epoll with non-blocking
+// sockets. With cold arrays on, every session is swept each interval, so
+// the large arrays of a session left idle end up compressed. With
+// hibernation on, a session that has waited that long for input is
+// written to an unnamed spill file and all its machine's memory freed;
+// it is read back (mapped, see um_32_snapshot_read) when it next runs.
+//
+// Sessions belong to tenants: the peer's IP address, or its uid over a
+// Unix socket. CPU is shared between tenants in proportion to their
+// weights, by charging every instruction a session retires to its
+// tenant's virtual time and always running a session of the tenant that
+// is furthest behind; within a tenant, sessions take turns. A session
+// that has just been sent input jumps the queue once, for a quantum
+// short enough that a keystroke is answered before any batch machine
+// gets going again, and that is charged like any other. A round ends
+// once HOST_ROUND instructions have run, so new input is never left
+// waiting behind more than that.
+#define HOST_QUANTUM    (1 << 20)
+#define HOST_BOOST      (1 << 18)
+#define HOST_ROUND      HOST_QUANTUM
+#define HOST_VTIME_SCALE 256
+#define HOST_LAT_BUCKETS (64 * 8)
+#define HOST_IN_SIZE    4096
+#define HOST_OUT_MIN    4096
+#define HOST_OUT_HIGH   (256 * 1024)
+#define HOST_RING_SIZE  4096
+#define HOST_MAX_EVENTS 256
+
+enum {
+    TAG_ACCEPT,
+    TAG_RECV,
+    TAG_SEND,
+    TAG_MASK = 3,
+};
+
+struct Tenant;
+
+typedef struct Session {
+    struct Session *run_next;
+    struct Tenant *tenant;
+    struct Session *all_prev;   // every session not yet reaped
+    struct Session *all_next;
+    uint64_t id;
+    int fd;
+    Machine vm;
+    bool queued;
+    bool asleep;        // hibernated to `spill_fd`
+    int spill_fd;
+    uint64_t blocked_at;    // host tick when it last waited for input
+    bool boosted;       // sent input since it last ran
+    double input_at;    // when the oldest input not yet answered came in
+    bool throttled;     // too much output waiting to be sent
+    bool done;          // machine halted or failed, or the peer went away
+    uint8_t in[HOST_IN_SIZE];
+    size_t in_len;
+    size_t in_pos;
+    bool in_eof;
+    bool want_input;
+    bool recv_posted;
+    uint8_t *fill;      // output the machine is writing
+    size_t fill_len;
+    size_t fill_cap;
+    uint8_t *send;      // output being sent
+    size_t send_len;
+    size_t send_off;
+    size_t send_cap;
+    bool send_posted;
+    uint32_t ep_events;
+    bool closed;
+    struct Session *dead_next;
+} Session;
+
+typedef struct Tenant {
+    struct Tenant *next;
+    char key[64];       // "192.0.2.1", "uid:1000"
+    unsigned weight;
+    uint64_t vtime;     // instructions run, scaled down by the weight
+    uint64_t insns;
+    uint64_t sessions;
+    Session *run_head;
+    Session *run_tail;
+    bool listed;        // on the host's list of tenants with work
+    struct Tenant *ready_next;
+    uint64_t latency[HOST_LAT_BUCKETS];   // input to output, log-scale us
+    uint64_t inputs;
+} Tenant;
+
+typedef struct Uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+} Uring;
+
+typedef struct Host {
+    Buffer prog;
+    int listen_fd;
+    bool use_uring;
+    Uring ring;
+    int epfd;
+    Session *boost_head;    // sessions just sent input
+    Session *boost_tail;
+    Tenant *ready;      // tenants with sessions to run
+    Tenant *tenants;
+    uint64_t vclock;    // virtual time of the last tenant picked
+    Session *dead;      // closed sessions, freed at the end of the round
+    Session *all;
+    unsigned cold_secs; // 0: no cold arrays
+    ColdStats cold;     // of the sessions reaped so far
+    unsigned idle_secs; // 0: never hibernate
+    const char *spill_dir;
+    uint64_t ticks;     // seconds, if either of the above is on
+    uint64_t asleep;
+    uint64_t hibernations;
+    uint64_t wakes;
+    double wake_seconds;
+    uint64_t next_id;
+    uint64_t live;
+    uint64_t served;
+    uint64_t io_syscalls;
+} Host;
+
+static volatile sig_atomic_t host_stop;
+static volatile sig_atomic_t host_tick;
+
+static void host_request_stop(int sig)
+{
+    host_stop = 1;
+}
+
+static void host_request_tick(int sig)
+{
+    host_tick = 1;
+}
+
+static void host_post_recv(Host *h, Session *s);
+static void host_post_send(Host *h, Session *s);
+
+// SESSION CONSOLE BACKEND
+
+static uint8_t *session_out_span(void *ctx, size_t *cap)
+{
+    Session *s = ctx;
+    if (s->fill_len == s->fill_cap) {
+        s->fill_cap = s->fill_cap ? s->fill_cap * 2 : HOST_OUT_MIN;
+        s->fill = xrealloc(s->fill, s->fill_cap);
+    }
+    *cap = s->fill_cap - s->fill_len;
+    return s->fill + s->fill_len;
+}
+
+static void session_out_commit(void *ctx, size_t n)
+{
+    Session *s = ctx;
+    s->fill_len += n;
+}
+
+static int session_in_span(void *ctx, const uint8_t **data, size_t *len)
+{
+    Session *s = ctx;
+    if (s->in_pos < s->in_len) {
+        *data = s->in + s->in_pos;
+        *len = s->in_len - s->in_pos;
+        return IO_OK;
+    }
+    if (s->in_eof) {
+        return IO_EOF;
+    }
+    s->in_pos = s->in_len = 0;
+    s->want_input = true;
+    return IO_AGAIN;
+}
+
+static void session_in_consume(void *ctx, size_t n)
+{
+    Session *s = ctx;
+    s->in_pos += n;
+}
+
+// RUN QUEUE
+
+static void queue_push(Session **head, Session **tail, Session *s)
+{
+    s->run_next = NULL;
+    if (*tail) {
+        (*tail)->run_next = s;
+    } else {
+        *head = s;
+    }
+    *tail = s;
+}
+
+static Session *queue_pop(Session **head, Session **tail)
+{
+    Session *s = *head;
+    if (s) {
+        *head = s->run_next;
+        if (!*head) {
+            *tail = NULL;
+        }
+    }
+    return s;
+}
+
+static void host_enqueue(Host *h, Session *s)
+{
+    if (s->queued || s->done) {
+        return;
+    }
+    s->queued = true;
+    if (s->boosted) {
+        queue_push(&h->boost_head, &h->boost_tail, s);
+        return;
+    }
+    Tenant *t = s->tenant;
+    queue_push(&t->run_head, &t->run_tail, s);
+    if (!t->listed) {
+        // Time spent with nothing to run is not owed back.
+        if (t->vtime < h->vclock) {
+            t->vtime = h->vclock;
+        }
+        t->listed = true;
+        t->ready_next = h->ready;
+        h->ready = t;
+    }
+}
+
+static Session *host_dequeue(Host *h)
+{
+    Session *s = queue_pop(&h->boost_head, &h->boost_tail);
+    if (!s) {
+        Tenant **best = NULL;
+        for (Tenant **tp = &h->ready; *tp; tp = &(*tp)->ready_next) {
+            if (!best || (*tp)->vtime < (*best)->vtime) {
+                best = tp;
+            }
+        }
+        if (!best) {
+            return NULL;
+        }
+        Tenant *t = *best;
+        s = queue_pop(&t->run_head, &t->run_tail);
+        if (!t->run_head) {
+            *best = t->ready_next;
+            t->listed = false;
+        }
+        if (t->vtime > h->vclock) {
+            h->vclock = t->vtime;
+        }
+    }
+    s->queued = false;
+    return s;
+}
+
+static void host_charge(Session *s, uint64_t n)
+{
+    Tenant *t = s->tenant;
+    t->insns += n;
+    t->vtime += n * HOST_VTIME_SCALE / t->weight;
+}
+
+// TENANTS
+
+static Tenant *host_tenant(Host *h, const char *key)
+{
+    for (Tenant *t = h->tenants; t; t = t->next) {
+        if (strcmp(t->key, key) == 0) {
+            return t;
+        }
+    }
+    Tenant *t = xcalloc(1, sizeof(Tenant));
+    snprintf(t->key, sizeof(t->key), "%s", key);
+    t->weight = 1;
+    t->vtime = h->vclock;
+    t->next = h->tenants;
+    h->tenants = t;
+    return t;
+}
+
+static Tenant *host_peer_tenant(Host *h, int fd)
+{
+    char key[64] = "unknown";
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    if (getpeername(fd, (struct sockaddr *)&ss, &len) == 0) {
+        if (ss.ss_family == AF_INET) {
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&ss)->sin_addr, key, sizeof(key));
+        } else if (ss.ss_family == AF_UNIX) {
+            struct ucred cred;
+            socklen_t clen = sizeof(cred);
+            if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &clen) == 0) {
+                snprintf(key, sizeof(key), "uid:%u", (unsigned)cred.uid);
+            }
+        }
+    }
+    return host_tenant(h, key);
+}
+
+// Input-to-output latencies go in buckets of an eighth of a power of two
+// of microseconds.
+static void tenant_record_latency(Tenant *t, double secs)
+{
+    uint64_t us = secs * 1e6;
+    size_t b = us;
+    if (us >= 8) {
+        int msb = 63 - __builtin_clzll(us);
+        b = msb * 8 + ((us >> (msb - 3)) & 7);
+    }
+    t->latency[b < HOST_LAT_BUCKETS ? b : HOST_LAT_BUCKETS - 1]++;
+    t->inputs++;
+}
+
+// The upper end of the bucket holding the `q` quantile, in milliseconds.
+static double tenant_latency_quantile(Tenant *t, double q)
+{
+    uint64_t want = q * t->inputs, seen = 0;
+    for (size_t b = 0; b < HOST_LAT_BUCKETS; b++) {
+        seen += t->latency[b];
+        if (seen > want || seen == t->inputs) {
+            if (b < 8) {
+                return (b + 1) / 1e3;
+            }
+            uint64_t msb = b / 8, sub = b % 8;
+            return ((8 + sub + 1) << (msb - 3)) / 1e3;
+        }
+    }
+    return 0;
+}
+
+// SESSION LIFECYCLE
+
+static void host_start_session(Host *h, int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (!h->use_uring) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    Session *s = xcalloc(1, sizeof(Session));
+    s->id = h->next_id++;
+    s->fd = fd;
+    s->tenant = host_peer_tenant(h, fd);
+    s->tenant->sessions++;
+    um_32_init(&s->vm, h->prog);
+    s->vm.io.ctx = s;
+    s->vm.io.out_span = session_out_span;
+    s->vm.io.out_commit = session_out_commit;
+    s->vm.io.in_span = session_in_span;
+    s->vm.io.in_consume = session_in_consume;
+    if (h->cold_secs) {
+        um_32_cold_start(&s->vm);
+    }
+    s->all_next = h->all;
+    if (h->all) {
+        h->all->all_prev = s;
+    }
+    h->all = s;
+    h->live++;
+    h->served++;
+    host_enqueue(h, s);
+}
+
+static void host_maybe_close(Host *h, Session *s)
+{
+    if (s->closed || !s->done || s->queued || s->recv_posted || s->send_posted || s->fill_len) {
+        return;
+    }
+    if (!h->use_uring && s->ep_events) {
+        epoll_ctl(h->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    }
+    close(s->fd);
+    s->closed = true;
+    s->dead_next = h->dead;
+    h->dead = s;
+    h->live--;
+}
+
+static void host_add_cold(ColdStats *sum, const ColdStats *st)
+{
+    sum->sweeps += st->sweeps;
+    sum->packed += st->packed;
+    sum->warmed += st->warmed;
+    sum->seconds += st->seconds;
+    sum->raw += st->raw;
+    sum->comp += st->comp;
+    sum->narrowed += st->narrowed;
+    sum->widened += st->widened;
+}
+
+// Sweeps every session; none of them is inside um_32_run just now.
+static void host_sweep(Host *h)
+{
+    for (Session *s = h->all; s; s = s->all_next) {
+        if (!s->done && !s->asleep) {
+            um_32_chill(&s->vm);
+        }
+    }
+}
+
+static double host_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Spills every session that has waited `idle_secs` for input. Whatever
+// it has written but not yet sent stays behind with the session.
+static void host_hibernate_idle(Host *h)
+{
+    for (Session *s = h->all; s; s = s->all_next) {
+        if (s->asleep || s->done || s->queued || !s->recv_posted ||
+            h->ticks - s->blocked_at < h->idle_secs) {
+            continue;
+        }
+        int fd = open(h->spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            perror("creating spill file");
+            return;
+        }
+        if (!um_32_hibernate(&s->vm, fd)) {
+            fprintf(stderr, "session %lu: hibernating: %s\n",
+                    (unsigned long)s->id, strerror(errno));
+            close(fd);
+            continue;
+        }
+        if (!s->fill_len) {
+            free(s->fill);
+            s->fill = NULL;
+            s->fill_cap = 0;
+        }
+        if (!s->send_posted) {
+            free(s->send);
+            s->send = NULL;
+            s->send_cap = 0;
+        }
+        s->spill_fd = fd;
+        s->asleep = true;
+        h->asleep++;
+        h->hibernations++;
+    }
+}
+
+static bool host_wake(Host *h, Session *s)
+{
+    double t0 = host_now();
+    bool ok = um_32_wake(&s->vm, s->spill_fd);
+    if (!ok) {
+        fprintf(stderr, "session %lu: waking: %s\n", (unsigned long)s->id, strerror(errno));
+    }
+    close(s->spill_fd);
+    s->asleep = false;
+    h->asleep--;
+    if (ok && h->cold_secs) {
+        um_32_cold_start(&s->vm);
+    }
+    h->wakes++;
+    h->wake_seconds += host_now() - t0;
+    return ok;
+}
+
+static void host_reap(Host *h)
+{
+    while (h->dead) {
+        Session *s = h->dead;
+        h->dead = s->dead_next;
+        if (s->all_prev) {
+            s->all_prev->all_next = s->all_next;
+        } else {
+            h->all = s->all_next;
+        }
+        if (s->all_next) {
+            s->all_next->all_prev = s->all_prev;
+        }
+        if (s->asleep) {
+            close(s->spill_fd);
+            h->asleep--;
+        }
+        // Its arrays go, so none of them counts as cold any more.
+        s->vm.cold_stats.raw = s->vm.cold_stats.comp = 0;
+        host_add_cold(&h->cold, &s->vm.cold_stats);
+        um_32_shutdown(&s->vm);
+        free(s->fill);
+        free(s->send);
+        free(s);
+    }
+}
+
+// Moves freshly written output into the send buffer and gets it going.
+static void host_flush(Host *h, Session *s)
+{
+    if (s->send_posted || !s->fill_len) {
+        return;
+    }
+    uint8_t *buf = s->send;
+    size_t cap = s->send_cap;
+    s->send = s->fill;
+    s->send_cap = s->fill_cap;
+    s->send_len = s->fill_len;
+    s->send_off = 0;
+    s->fill = buf;
+    s->fill_cap = cap;
+    s->fill_len = 0;
+    s->send_posted = true;
+    host_post_send(h, s);
+}
+
+static void host_on_recv(Host *h, Session *s, ssize_t n)
+{
+    s->recv_posted = false;
+    if (n > 0) {
+        s->in_len = n;
+        s->in_pos = 0;
+        s->boosted = true;
+        if (!s->input_at) {
+            s->input_at = host_now();
+        }
+    } else {
+        s->in_eof = true;
+    }
+    s->want_input = false;
+    host_enqueue(h, s);
+    host_maybe_close(h, s);
+}
+
+static void host_on_send(Host *h, Session *s, ssize_t n)
+{
+    if (n < 0) {
+        // The peer is gone: drop its output and stop the machine.
+        s->send_posted = false;
+        s->fill_len = 0;
+        s->done = true;
+        host_maybe_close(h, s);
+        return;
+    }
+    s->send_off += n;
+    if (s->send_off < s->send_len) {
+        host_post_send(h, s);
+        return;
+    }
+    s->send_posted = false;
+    host_flush(h, s);
+    if (s->throttled && s->fill_len < HOST_OUT_HIGH) {
+        s->throttled = false;
+        host_enqueue(h, s);
+    }
+    host_maybe_close(h, s);
+}
+
+// Returns the number of instructions run.
+static uint64_t host_run_session(Host *h, Session *s)
+{
+    if (s->done) {
+        host_maybe_close(h, s);
+        return 0;
+    }
+    if (s->fill_len >= HOST_OUT_HIGH) {
+        s->throttled = true;
+        host_flush(h, s);
+        return 0;
+    }
+    if (s->asleep && !host_wake(h, s)) {
+        s->done = true;
+        host_maybe_close(h, s);
+        return 0;
+    }
+    uint64_t icount = s->vm.icount;
+    size_t fill_len = s->fill_len;
+    um_32_descriptor.vm = &s->vm;
+    RunStatus status = um_32_run(&s->vm, s->boosted ? HOST_BOOST : HOST_QUANTUM);
+    um_32_descriptor.vm = NULL;
+    // A quantum can end with an output span still open in `fill`, which
+    // host_flush may hand off to the send side before the machine next runs.
+    um_32_flush_output(&s->vm);
+    s->boosted = false;
+    uint64_t ran = s->vm.icount - icount;
+    host_charge(s, ran);
+    if (s->input_at && (s->fill_len > fill_len || status == RUN_HALTED ||
+                        status == RUN_FAILED)) {
+        tenant_record_latency(s->tenant, host_now() - s->input_at);
+        s->input_at = 0;
+    }
+    switch (status) {
+        case RUN_YIELDED:
+            host_enqueue(h, s);
+            break;
+        case RUN_BLOCKED:
+            s->blocked_at = h->ticks;
+            host_post_recv(h, s);
+            break;
+        case RUN_FAILED:
+            fprintf(stderr, "session %lu: machine failed at PC=%u\n",
+                    (unsigned long)s->id, s->vm.PC);
+            s->done = true;
+            break;
+        case RUN_HALTED:
+            s->done = true;
+            break;
+    }
+    host_flush(h, s);
+    host_maybe_close(h, s);
+    return ran;
+}
+
+// IO_URING
+
+static bool uring_init(Uring *u, unsigned entries)
+{
+    struct io_uring_params p = {0};
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return false;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+    uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uint8_t *cq = sq;
+    if (!single && sq != MAP_FAILED) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    u->fd = fd;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sqes = sqes;
+    u->to_submit = 0;
+    return true;
+}
+
+static int uring_enter(Host *h, unsigned min_complete)
+{
+    Uring *u = &h->ring;
+    int r = syscall(__NR_io_uring_enter, u->fd, u->to_submit, min_complete,
+                    min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    h->io_syscalls++;
+    if (r >= 0) {
+        u->to_submit -= r;
+    }
+    return r;
+}
+
+static struct io_uring_sqe *uring_get_sqe(Host *h)
+{
+    Uring *u = &h->ring;
+    unsigned tail = *u->sq_tail;
+    while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (uring_enter(h, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    return sqe;
+}
+
+static void uring_push(Host *h)
+{
+    Uring *u = &h->ring;
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+}
+
+static void uring_post(Host *h, uint8_t opcode, int fd, void *buf, size_t len,
+                       uint32_t flags, Session *s, int tag)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(h);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = flags;
+    sqe->user_data = (uintptr_t)s | tag;
+    uring_push(h);
+}
+
+static void uring_wait(Host *h, bool block)
+{
+    Uring *u = &h->ring;
+    // Completions are reaped straight from the ring; only enter the kernel
+    // to submit or to sleep.
+    if ((block || u->to_submit) && uring_enter(h, block ? 1 : 0) < 0 && errno != EINTR) {
+        perror("io_uring_enter");
+        exit(1);
+    }
+    unsigned head = *u->cq_head;
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+        head++;
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        Session *s = (Session *)(uintptr_t)(cqe.user_data & ~(uint64_t)TAG_MASK);
+        switch (cqe.user_data & TAG_MASK) {
+            case TAG_ACCEPT:
+                if (cqe.res >= 0) {
+                    host_start_session(h, cqe.res);
+                }
+                uring_post(h, IORING_OP_ACCEPT, h->listen_fd, NULL, 0, 0, NULL, TAG_ACCEPT);
+                break;
+            case TAG_RECV:
+                host_on_recv(h, s, cqe.res);
+                break;
+            case TAG_SEND:
+                host_on_send(h, s, cqe.res);
+                break;
+        }
+    }
+}
+
+// EPOLL FALLBACK
+
+static void epoll_update(Host *h, Session *s)
+{
+    if (s->closed) {
+        return;
+    }
+    uint32_t events = (s->recv_posted ? EPOLLIN : 0) | (s->send_posted ? EPOLLOUT : 0);
+    if (events == s->ep_events) {
+        return;
+    }
+    struct epoll_event ev = {.events = events, .data.ptr = s};
+    int op = !s->ep_events ? EPOLL_CTL_ADD : events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    epoll_ctl(h->epfd, op, s->fd, &ev);
+    h->io_syscalls++;
+    s->ep_events = events;
+}
+
+static void epoll_send(Host *h, Session *s)
+{
+    ssize_t n = send(s->fd, s->send + s->send_off, s->send_len - s->send_off, MSG_NOSIGNAL);
+    h->io_syscalls++;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        epoll_update(h, s);
+        return;
+    }
+    host_on_send(h, s, n);
+    epoll_update(h, s);
+}
+
+static void epoll_wait_events(Host *h, bool block)
+{
+    struct epoll_event events[HOST_MAX_EVENTS];
+    int n = epoll_wait(h->epfd, events, HOST_MAX_EVENTS, block ? -1 : 0);
+    h->io_syscalls++;
+    for (int i = 0; i < n; i++) {
+        Session *s = events[i].data.ptr;
+        if (!s) {
+            int fd;
+            while ((fd = accept4(h->listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                h->io_syscalls++;
+                host_start_session(h, fd);
+            }
+            continue;
+        }
+        if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && s->recv_posted) {
+            ssize_t r = recv(s->fd, s->in, sizeof(s->in), 0);
+            h->io_syscalls++;
+            if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            host_on_recv(h, s, r);
+            epoll_update(h, s);
+        } else if ((events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && s->send_posted) {
+            epoll_send(h, s);
+        }
+    }
+}
+
+// DISPATCH
+
+static void host_post_recv(Host *h, Session *s)
+{
+    if (s->recv_posted || s->in_eof) {
+        return;
+    }
+    s->recv_posted = true;
+    if (h->use_uring) {
+        uring_post(h, IORING_OP_RECV, s->fd, s->in, sizeof(s->in), 0, s, TAG_RECV);
+    } else {
+        epoll_update(h, s);
+    }
+}
+
+static void host_post_send(Host *h, Session *s)
+{
+    if (h->use_uring) {
+        uring_post(h, IORING_OP_SEND, s->fd, s->send + s->send_off,
+                   s->send_len - s->send_off, MSG_NOSIGNAL, s, TAG_SEND);
+    } else {
+        epoll_send(h, s);
+    }
+}
+
+static int host_listen(const char *addr)
+{
+    int fd;
+    bool tcp = addr[strspn(addr, "0123456789")] == '\0';
+    if (tcp) {
+        struct sockaddr_in sin = {0};
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(atoi(addr));
+        sin.sin_addr.s_addr = htonl(INADDR_ANY);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+            return -1;
+        }
+    } else {
+        struct sockaddr_un sun = {0};
+        sun.sun_family = AF_UNIX;
+        snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", addr);
+        unlink(addr);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            return -1;
+        }
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        return -1;
+    }
+    return fd;
+}
+
+// Serves `prog` to every client connecting to `addr` (a TCP port number or
+// a Unix socket path) until SIGINT or SIGTERM.
+int um_32_host(Buffer prog, const char *addr, bool force_epoll, unsigned cold_secs,
+               unsigned idle_secs, const TenantWeight *weights, int nweights)
+{
+    Host h = {0};
+    h.prog = prog;
+    for (int i = 0; i < nweights; i++) {
+        host_tenant(&h, weights[i].tenant)->weight = weights[i].weight;
+    }
+    h.cold_secs = cold_secs;
+    h.idle_secs = idle_secs;
+    h.spill_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    h.listen_fd = host_listen(addr);
+    if (h.listen_fd < 0) {
+        perror("listening for sessions");
+        return 1;
+    }
+    h.use_uring = !force_epoll && uring_init(&h.ring, HOST_RING_SIZE);
+    if (h.use_uring) {
+        uring_post(&h, IORING_OP_ACCEPT, h.listen_fd, NULL, 0, 0, NULL, TAG_ACCEPT);
+    } else {
+        fcntl(h.listen_fd, F_SETFL, fcntl(h.listen_fd, F_GETFL) | O_NONBLOCK);
+        h.epfd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if (h.epfd < 0 || epoll_ctl(h.epfd, EPOLL_CTL_ADD, h.listen_fd, &ev) < 0) {
+            perror("setting up epoll");
+            return 1;
+        }
+    }
+    fprintf(stderr, "** serving on %s using %s\n", addr, h.use_uring ? "io_uring" : "epoll");
+
+    struct sigaction sa = {0};
+    sa.sa_handler = host_request_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    if (cold_secs || idle_secs) {
+        // No SA_RESTART, so the tick wakes an idle host.
+        sa.sa_handler = host_request_tick;
+        sigaction(SIGALRM, &sa, NULL);
+        struct itimerval it = {{1, 0}, {1, 0}};
+        setitimer(ITIMER_REAL, &it, NULL);
+    }
+
+    while (!host_stop) {
+        // Run sessions, fairest first, until there is nothing left to run
+        // or the round has gone on long enough that input may be waiting.
+        uint64_t round = 0;
+        Session *s;
+        while (round < HOST_ROUND && (s = host_dequeue(&h))) {
+            round += host_run_session(&h, s);
+        }
+        bool idle = !h.boost_head && !h.ready;
+        if (h.use_uring) {
+            uring_wait(&h, idle);
+        } else {
+            epoll_wait_events(&h, idle);
+        }
+        host_reap(&h);
+        if (host_tick) {
+            host_tick = 0;
+            h.ticks++;
+            if (cold_secs && h.ticks % cold_secs == 0) {
+                host_sweep(&h);
+            }
+            if (idle_secs) {
+                host_hibernate_idle(&h);
+            }
+        }
+    }
+    fprintf(stderr, "** served %lu sessions (%lu live), %lu I/O syscalls\n",
+            (unsigned long)h.served, (unsigned long)h.live,
+            (unsigned long)h.io_syscalls);
+    if (cold_secs) {
+        for (Session *s = h.all; s; s = s->all_next) {
+            host_add_cold(&h.cold, &s->vm.cold_stats);
+        }
+        um_32_print_cold(&h.cold);
+    }
+    uint64_t total = 0;
+    for (Tenant *t = h.tenants; t; t = t->next) {
+        total += t->insns;
+    }
+    for (Tenant *t = h.tenants; t; t = t->next) {
+        fprintf(stderr, "** tenant %s, weight %u: %lu sessions, %.1f%% of %llu instructions",
+                t->key, t->weight, (unsigned long)t->sessions,
+                total ? 100.0 * t->insns / total : 0, (unsigned long long)total);
+        if (t->inputs) {
+            fprintf(stderr, "; input to output p50 %.2f ms, p99 %.2f ms, max %.2f ms",
+                    tenant_latency_quantile(t, 0.5), tenant_latency_quantile(t, 0.99),
+                    tenant_latency_quantile(t, 1));
+        }
+        fprintf(stderr, "\n");
+    }
+    if (idle_secs) {
+        fprintf(stderr, "** %lu hibernations (%lu asleep now), %lu wakes taking %.1f ms on average\n",
+                (unsigned long)h.hibernations, (unsigned long)h.asleep, (unsigned long)h.wakes,
+                h.wakes ? h.wake_seconds / h.wakes * 1e3 : 0);
+    }
+    while (h.tenants) {
+        Tenant *t = h.tenants;
+        h.tenants = t->next;
+        free(t);
+    }
+    return 0;
+}
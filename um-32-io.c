@@ -0,0 +1,371 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+#include <poll.h>
+#include <sys/socket.h>
+
+#define IO_BUFFER_SIZE (64 * 1024)
+
+// fd and socket backends: one buffer each way, handed out as spans.
+typedef struct FdIo {
+    int in_fd;
+    int out_fd;
+    bool socket;
+    bool nonblock;          // report IO_AGAIN rather than wait for input
+    uint8_t in[IO_BUFFER_SIZE];
+    size_t in_len;
+    uint8_t out[IO_BUFFER_SIZE];
+} FdIo;
+
+static uint8_t *fd_out_span(void *ctx, size_t *cap)
+{
+    FdIo *io = ctx;
+    *cap = sizeof(io->out);
+    return io->out;
+}
+
+static void fd_out_commit(void *ctx, size_t n)
+{
+    FdIo *io = ctx;
+    const uint8_t *p = io->out;
+    while (n) {
+        ssize_t w = io->socket ? send(io->out_fd, p, n, MSG_NOSIGNAL)
+                               : write(io->out_fd, p, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            // The console went away; there is nobody left to tell.
+            return;
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+static int fd_in_span(void *ctx, const uint8_t **data, size_t *len)
+{
+    FdIo *io = ctx;
+    if (io->in_len == 0) {
+        if (io->nonblock) {
+            struct pollfd p = {io->in_fd, POLLIN, 0};
+            if (poll(&p, 1, 0) == 0) {
+                return IO_AGAIN;
+            }
+        }
+        ssize_t r;
+        do {
+            r = io->socket ? recv(io->in_fd, io->in, sizeof(io->in), 0)
+                           : read(io->in_fd, io->in, sizeof(io->in));
+            // A signal that wants the machine's attention gets it now,
+            // rather than once some input turns up.
+            if (r < 0 && errno == EINTR && um_32_attention) {
+                return IO_AGAIN;
+            }
+        } while (r < 0 && errno == EINTR);
+        if (r <= 0) {
+            return IO_EOF;
+        }
+        io->in_len = r;
+    }
+    *data = io->in;
+    *len = io->in_len;
+    return IO_OK;
+}
+
+static void fd_in_consume(void *ctx, size_t n)
+{
+    FdIo *io = ctx;
+    memmove(io->in, io->in + n, io->in_len - n);
+    io->in_len -= n;
+}
+
+void um_32_io_fd(IoBackend *io, int in_fd, int out_fd)
+{
+    FdIo *fio = xcalloc(1, sizeof(FdIo));
+    fio->in_fd = in_fd;
+    fio->out_fd = out_fd;
+    *io = (IoBackend){0};
+    io->ctx = fio;
+    io->out_span = fd_out_span;
+    io->out_commit = fd_out_commit;
+    io->in_span = fd_in_span;
+    io->in_consume = fd_in_consume;
+    io->destroy = free;
+    io->line_flush = isatty(out_fd);
+}
+
+// Makes an fd backend stop waiting for input; other backends are left
+// alone and false is returned.
+bool um_32_io_fd_nonblock(IoBackend *io, bool on)
+{
+    if (io->in_span != fd_in_span) {
+        return false;
+    }
+    ((FdIo *)io->ctx)->nonblock = on;
+    return true;
+}
+
+// Puts input back in front of whatever an fd backend has buffered.
+bool um_32_io_fd_preload(IoBackend *io, const uint8_t *data, size_t len)
+{
+    if (io->in_span != fd_in_span) {
+        return false;
+    }
+    FdIo *fio = io->ctx;
+    if (len > sizeof(fio->in) - fio->in_len) {
+        return false;
+    }
+    memmove(fio->in + len, fio->in, fio->in_len);
+    memcpy(fio->in, data, len);
+    fio->in_len += len;
+    return true;
+}
+
+void um_32_io_socket(IoBackend *io, int sock)
+{
+    um_32_io_fd(io, sock, sock);
+    ((FdIo *)io->ctx)->socket = true;
+    io->line_flush = false;
+}
+
+// stdio backend for hosts that already hold FILE handles. Input is taken
+// a byte at a time since stdio cannot say how much is available without
+// blocking; output goes out through fwrite in spans.
+typedef struct StdioIo {
+    FILE *in;
+    FILE *out;
+    uint8_t in_byte;
+    bool has_byte;
+    uint8_t out_buf[IO_BUFFER_SIZE];
+} StdioIo;
+
+static uint8_t *stdio_out_span(void *ctx, size_t *cap)
+{
+    StdioIo *io = ctx;
+    *cap = sizeof(io->out_buf);
+    return io->out_buf;
+}
+
+static void stdio_out_commit(void *ctx, size_t n)
+{
+    StdioIo *io = ctx;
+    fwrite(io->out_buf, 1, n, io->out);
+    fflush(io->out);
+}
+
+static int stdio_in_span(void *ctx, const uint8_t **data, size_t *len)
+{
+    StdioIo *io = ctx;
+    if (!io->has_byte) {
+        int c = getc(io->in);
+        if (c == EOF) {
+            return IO_EOF;
+        }
+        io->in_byte = c;
+        io->has_byte = true;
+    }
+    *data = &io->in_byte;
+    *len = 1;
+    return IO_OK;
+}
+
+static void stdio_in_consume(void *ctx, size_t n)
+{
+    StdioIo *io = ctx;
+    if (n) {
+        io->has_byte = false;
+    }
+}
+
+void um_32_io_stdio(IoBackend *io, FILE *in, FILE *out)
+{
+    StdioIo *sio = xcalloc(1, sizeof(StdioIo));
+    sio->in = in;
+    sio->out = out;
+    *io = (IoBackend){0};
+    io->ctx = sio;
+    io->out_span = stdio_out_span;
+    io->out_commit = stdio_out_commit;
+    io->in_span = stdio_in_span;
+    io->in_consume = stdio_in_consume;
+    io->destroy = free;
+    io->line_flush = isatty(fileno(out));
+}
+
+// Memory backend: the machine reads straight out of the host's input
+// buffer and writes straight into its output buffer.
+static uint8_t *mem_out_span(void *ctx, size_t *cap)
+{
+    MemIo *io = ctx;
+    if (io->out_len == io->out_cap) {
+        if (io->out_grow) {
+            io->out_cap = io->out_cap ? io->out_cap * 2 : IO_BUFFER_SIZE;
+            io->out = xrealloc(io->out, io->out_cap);
+        } else {
+            // Full fixed buffer: keep going, but drop what doesn't fit.
+            io->overflow = true;
+            *cap = sizeof(io->scratch);
+            return io->scratch;
+        }
+    }
+    *cap = io->out_cap - io->out_len;
+    return io->out + io->out_len;
+}
+
+static void mem_out_commit(void *ctx, size_t n)
+{
+    MemIo *io = ctx;
+    if (io->out_len < io->out_cap) {
+        io->out_len += n;
+    }
+}
+
+static int mem_in_span(void *ctx, const uint8_t **data, size_t *len)
+{
+    MemIo *io = ctx;
+    if (io->in_pos == io->in_len) {
+        return IO_EOF;
+    }
+    *data = io->in + io->in_pos;
+    *len = io->in_len - io->in_pos;
+    return IO_OK;
+}
+
+static void mem_in_consume(void *ctx, size_t n)
+{
+    MemIo *io = ctx;
+    io->in_pos += n;
+}
+
+void um_32_io_memory(IoBackend *io, MemIo *mem)
+{
+    *io = (IoBackend){0};
+    io->ctx = mem;
+    io->out_span = mem_out_span;
+    io->out_commit = mem_out_commit;
+    io->in_span = mem_in_span;
+    io->in_consume = mem_in_consume;
+}
+
+// Capture backend: passes everything through to `inner` until the marker
+// has been written, then collects the output as a program image. Input
+// always comes from `inner`, so whatever it has buffered is still there
+// for the machine that runs the image.
+typedef struct CaptureIo {
+    IoBackend *inner;
+    Capture *cap;
+    size_t matched;         // marker bytes matched so far
+    size_t *fail;           // KMP failure function of the marker
+    size_t marker_len;
+    uint8_t *span;          // span lent by `inner`, while passing through
+    uint8_t buf[IO_BUFFER_SIZE];
+} CaptureIo;
+
+static void capture_bytes(Capture *cap, const uint8_t *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        cap->partial = cap->partial << 8 | p[i];
+        if (++cap->npartial < 4) {
+            continue;
+        }
+        if (cap->len == cap->cap) {
+            cap->cap = cap->cap ? cap->cap * 2 : IO_BUFFER_SIZE;
+            cap->words = xrealloc(cap->words, sizeof(uint32_t) * cap->cap);
+        }
+        cap->words[cap->len++] = cap->partial;
+        cap->partial = 0;
+        cap->npartial = 0;
+    }
+}
+
+static uint8_t *capture_out_span(void *ctx, size_t *cap)
+{
+    CaptureIo *io = ctx;
+    if (io->cap->active) {
+        *cap = sizeof(io->buf);
+        return io->buf;
+    }
+    io->span = io->inner->out_span(io->inner->ctx, cap);
+    return io->span;
+}
+
+static void capture_out_commit(void *ctx, size_t n)
+{
+    CaptureIo *io = ctx;
+    if (io->cap->active) {
+        capture_bytes(io->cap, io->buf, n);
+        return;
+    }
+    const char *marker = io->cap->marker;
+    for (size_t i = 0; i < n; i++) {
+        uint8_t c = io->span[i];
+        while (io->matched && c != (uint8_t)marker[io->matched]) {
+            io->matched = io->fail[io->matched - 1];
+        }
+        if (c == (uint8_t)marker[io->matched]) {
+            io->matched++;
+        }
+        if (io->matched == io->marker_len) {
+            io->inner->out_commit(io->inner->ctx, i + 1);
+            io->cap->active = true;
+            capture_bytes(io->cap, io->span + i + 1, n - i - 1);
+            return;
+        }
+    }
+    io->inner->out_commit(io->inner->ctx, n);
+}
+
+static int capture_in_span(void *ctx, const uint8_t **data, size_t *len)
+{
+    CaptureIo *io = ctx;
+    return io->inner->in_span(io->inner->ctx, data, len);
+}
+
+static void capture_in_consume(void *ctx, size_t n)
+{
+    CaptureIo *io = ctx;
+    io->inner->in_consume(io->inner->ctx, n);
+}
+
+static void capture_destroy(void *ctx)
+{
+    CaptureIo *io = ctx;
+    free(io->fail);
+    free(io);
+}
+
+// Closing the capture backend leaves `inner` open.
+void um_32_io_capture(IoBackend *io, IoBackend *inner, Capture *cap)
+{
+    CaptureIo *cio = xcalloc(1, sizeof(CaptureIo));
+    cio->inner = inner;
+    cio->cap = cap;
+    cio->marker_len = strlen(cap->marker);
+    assert(cio->marker_len > 0);
+    cio->fail = xcalloc(cio->marker_len, sizeof(size_t));
+    for (size_t i = 1, k = 0; i < cio->marker_len; i++) {
+        while (k && cap->marker[i] != cap->marker[k]) {
+            k = cio->fail[k - 1];
+        }
+        if (cap->marker[i] == cap->marker[k]) {
+            k++;
+        }
+        cio->fail[i] = k;
+    }
+    *io = (IoBackend){0};
+    io->ctx = cio;
+    io->out_span = capture_out_span;
+    io->out_commit = capture_out_commit;
+    io->in_span = capture_in_span;
+    io->in_consume = capture_in_consume;
+    io->destroy = capture_destroy;
+    io->line_flush = inner->line_flush;
+}
+
+void um_32_io_close(IoBackend *io)
+{
+    if (io->destroy) {
+        io->destroy(io->ctx);
+    }
+    *io = (IoBackend){0};
+}
@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+#include "um-32-probes.h"
+#include <time.h>
+
+// Lockstep engine: many copies of one program, differing only in their
+// input, run LANES at a time with each register held as a vector of
+// lanes, so an ADD or a NAND is one vector operation for all of them.
+// Array accesses, ALLOC, ABANDON and the console go lane by lane, each
+// lane a Machine of its own for memory and I/O.
+//
+// Lanes whose fingers part (at LOAD_PROG) are run under a mask: the lanes
+// furthest behind go first while the rest wait, until they meet again. A
+// lane that does anything the engine leaves alone (loads or amends array
+// 0, is about to Fail, uses opcode 14 or 15, or would block on input) is
+// ejected: its registers and finger go back to its Machine, which runs
+// it through um_32_run from that very instruction once the others are
+// done.
+//
+// The vectors are GCC's generic vector extension; what instructions they
+// become is up to the target the tree is built for (SSE2 by default,
+// AVX2 or AVX-512 with the matching -m flags).
+
+#define LANES 8
+
+typedef uint32_t Vec __attribute__((vector_size(LANES * 4)));
+
+typedef struct Group {
+    Machine *lanes[LANES];
+    Vec R[8];
+    Vec pc;                 // fingers of the lanes not in the issuing set
+    Vec insts;              // instructions retired, lane by lane
+    uint32_t alive;         // lanes still in lockstep
+    uint64_t steps;         // instructions issued
+    uint64_t lane_insts;    // instructions retired, over all lanes
+} Group;
+
+typedef struct LockStats {
+    double seconds;
+    uint64_t steps;
+    uint64_t lane_insts;
+    uint64_t scalar_insts;  // retired by ejected lanes
+    int ejected;
+    int failed;
+} LockStats;
+
+static double lock_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Vectors are passed by pointer: returning one by value is a call ABI
+// that depends on the -m flags.
+static void lock_mask(Vec *m, uint32_t bits)
+{
+    for (int i = 0; i < LANES; i++) {
+        (*m)[i] = bits >> i & 1 ? 0xffffffff : 0;
+    }
+}
+
+// Like um_32_init, but array 0 is only decoded if the lane is ejected.
+static void lane_init(Machine *vm, const uint32_t *words, size_t len)
+{
+    Mem m0 = {um_32_alloc_program(vm, len), len, true};
+    memcpy(m0.inst, words, len * 4);
+    vm->memarr_cap = 64;
+    vm->M = region_alloc(&vm->region, sizeof(Mem) * vm->memarr_cap);
+    vm->memarr_count = 1;
+    vm->M[0] = m0;
+}
+
+// Hands lane `i`, stopped before the instruction at `pc`, to um_32_run.
+static void lane_eject(Group *g, int i, uint32_t pc)
+{
+    Machine *vm = g->lanes[i];
+    for (int r = 0; r < 8; r++) {
+        vm->R[r] = g->R[r][i];
+    }
+    vm->PC = pc;
+    vm->icount = g->insts[i];
+    g->alive &= ~(1u << i);
+}
+
+// Picks the lanes furthest behind to issue next; the rest keep their
+// fingers in g->pc.
+static void group_issue(Group *g, uint32_t *pc, uint32_t *bits)
+{
+    *pc = UINT32_MAX;
+    for (uint32_t b = g->alive; b; b &= b - 1) {
+        int i = __builtin_ctz(b);
+        if (g->pc[i] < *pc) {
+            *pc = g->pc[i];
+        }
+    }
+    *bits = 0;
+    for (uint32_t b = g->alive; b; b &= b - 1) {
+        int i = __builtin_ctz(b);
+        if (g->pc[i] == *pc) {
+            *bits |= 1u << i;
+        }
+    }
+}
+
+static void group_run(Group *g, const Decoded *code, uint32_t len)
+{
+    Vec *R = g->R;
+    uint32_t pc, bits;
+    group_issue(g, &pc, &bits);
+    Vec m;
+    lock_mask(&m, bits);
+    while (bits) {
+        Decoded d = code[pc];
+        uint32_t issued = bits;
+        bool split = false;     // fingers of the issuing lanes may differ
+        g->steps++;
+        switch (d.op) {
+            case CMOV:
+                {
+                    Vec sel = m & (Vec)(R[d.c] != 0);
+                    R[d.a] = (R[d.b] & sel) | (R[d.a] & ~sel);
+                }
+                break;
+            case ARRAY_INDEX:
+                for (uint32_t b = bits; b; b &= b - 1) {
+                    int i = __builtin_ctz(b);
+                    Machine *vm = g->lanes[i];
+                    uint32_t idx = R[d.b][i];
+                    if (idx >= vm->memarr_count || !vm->M[idx].active) {
+                        lane_eject(g, i, pc);
+                        continue;
+                    }
+                    R[d.a][i] = vm->M[idx].inst[R[d.c][i]];
+                }
+                break;
+            case ARRAY_AMEND:
+                for (uint32_t b = bits; b; b &= b - 1) {
+                    int i = __builtin_ctz(b);
+                    Machine *vm = g->lanes[i];
+                    uint32_t idx = R[d.a][i];
+                    // Amending array 0 would leave the lane running code
+                    // the others don't.
+                    if (idx == 0 || idx >= vm->memarr_count || !vm->M[idx].active) {
+                        lane_eject(g, i, pc);
+                        continue;
+                    }
+                    vm->M[idx].inst[R[d.b][i]] = R[d.c][i];
+                }
+                break;
+            case ADD:
+                R[d.a] = ((R[d.b] + R[d.c]) & m) | (R[d.a] & ~m);
+                break;
+            case MUL:
+                R[d.a] = ((R[d.b] * R[d.c]) & m) | (R[d.a] & ~m);
+                break;
+            case DIV:
+                {
+                    for (uint32_t b = bits; b; b &= b - 1) {
+                        int i = __builtin_ctz(b);
+                        if (R[d.c][i] == 0) {
+                            lane_eject(g, i, pc);
+                        }
+                    }
+                    Vec mm;
+                    lock_mask(&mm, g->alive);
+                    mm &= m;
+                    Vec one = {0};
+                    one += 1;
+                    Vec divisor = (R[d.c] & mm) | (one & ~mm);
+                    R[d.a] = ((R[d.b] / divisor) & mm) | (R[d.a] & ~mm);
+                }
+                break;
+            case NAND:
+                R[d.a] = (~(R[d.b] & R[d.c]) & m) | (R[d.a] & ~m);
+                break;
+            case HALT:
+                g->insts -= m;
+                for (uint32_t b = bits; b; b &= b - 1) {
+                    int i = __builtin_ctz(b);
+                    Machine *vm = g->lanes[i];
+                    vm->halted = true;
+                    um_32_flush_output(vm);
+                    UM_32_PROBE2(halt, pc, g->insts[i]);
+                }
+                g->lane_insts += __builtin_popcount(bits);
+                g->alive &= ~bits;
+                group_issue(g, &pc, &bits);
+                lock_mask(&m, bits);
+                continue;
+            case ALLOC:
+                for (uint32_t b = bits; b; b &= b - 1) {
+                    int i = __builtin_ctz(b);
+                    R[d.b][i] = um_32_op_alloc(g->lanes[i], R[d.c][i]);
+                }
+                break;
+            case ABANDON:
+                for (uint32_t b = bits; b; b &= b - 1) {
+                    int i = __builtin_ctz(b);
+                    Machine *vm = g->lanes[i];
+                    uint32_t idx = R[d.c][i];
+                    if (idx == 0 || idx >= vm->memarr_count || !vm->M[idx].active) {
+                        lane_eject(g, i, pc);
+                        continue;
+                    }
+                    um_32_op_abandon(vm, idx);
+                }
+                break;
+            case OUTPUT:
+                for (uint32_t b = bits; b; b &= b - 1) {
+                    int i = __builtin_ctz(b);
+                    um_32_op_output(g->lanes[i], R[d.c][i]);
+                }
+                break;
+            case INPUT:
+                for (uint32_t b = bits; b; b &= b - 1) {
+                    int i = __builtin_ctz(b);
+                    uint32_t c;
+                    if (um_32_op_input(g->lanes[i], &c) == IO_AGAIN) {
+                        lane_eject(g, i, pc);
+                        continue;
+                    }
+                    R[d.c][i] = c;
+                }
+                break;
+            case LOAD_PROG:
+                for (uint32_t b = bits; b; b &= b - 1) {
+                    int i = __builtin_ctz(b);
+                    uint32_t target = R[d.c][i];
+                    if (R[d.b][i] != 0 || target > len) {
+                        lane_eject(g, i, pc);
+                        continue;
+                    }
+                    UM_32_PROBE3(load_prog, 0, pc, target);
+                    g->pc[i] = target;
+                }
+                split = true;
+                break;
+            case ORTHOG:
+                {
+                    Vec v = {0};
+                    v += d.val;
+                    R[d.a] = (v & m) | (R[d.a] & ~m);
+                }
+                break;
+            default:
+                for (uint32_t b = bits; b; b &= b - 1) {
+                    lane_eject(g, __builtin_ctz(b), pc);
+                }
+                break;
+        }
+        bits &= g->alive;
+        g->lane_insts += __builtin_popcount(bits);
+        if (bits != issued) {
+            lock_mask(&m, bits);
+        }
+        g->insts -= m;
+        if (split || bits != issued) {
+            if (!split) {
+                for (uint32_t b = bits; b; b &= b - 1) {
+                    g->pc[__builtin_ctz(b)] = pc + 1;
+                }
+            }
+            group_issue(g, &pc, &bits);
+            lock_mask(&m, bits);
+            continue;
+        }
+        pc++;
+        // Lanes left waiting may be just where the issuing ones got to.
+        if (bits != g->alive) {
+            for (uint32_t b = g->alive & ~bits; b; b &= b - 1) {
+                int i = __builtin_ctz(b);
+                if (g->pc[i] == pc) {
+                    bits |= 1u << i;
+                }
+            }
+            lock_mask(&m, bits);
+        }
+    }
+}
+
+static bool read_input(const char *path, Buffer *buf)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    // An empty input is a fine thing to run a program on, but not to
+    // read_entire_file.
+    fseek(f, 0L, SEEK_END);
+    bool empty = ftell(f) == 0;
+    rewind(f);
+    *buf = empty ? (Buffer){0} : read_entire_file(f);
+    fclose(f);
+    return true;
+}
+
+static bool write_output(const char *input, const MemIo *mem)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.out", input);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    bool ok = fwrite(mem->out, 1, mem->out_len, f) == mem->out_len;
+    ok &= fclose(f) == 0;
+    return ok;
+}
+
+// Runs up to LANES machines in lockstep, then whatever lanes were ejected.
+static bool lock_group(const uint32_t *words, const Decoded *code, size_t len,
+                       char **inputs, int n, LockStats *st)
+{
+    Group g = {0};
+    Machine vms[LANES] = {{0}};
+    MemIo mems[LANES] = {{0}};
+    Buffer ins[LANES] = {{0}};
+    bool ok = true;
+    for (int i = 0; i < n; i++) {
+        if (!read_input(inputs[i], &ins[i])) {
+            ok = false;
+        }
+        mems[i].in = ins[i].data;
+        mems[i].in_len = ins[i].len;
+        mems[i].out_grow = true;
+        lane_init(&vms[i], words, len);
+        um_32_io_memory(&vms[i].io, &mems[i]);
+        g.lanes[i] = &vms[i];
+        g.alive |= 1u << i;
+    }
+    if (!ok) {
+        g.alive = 0;
+    }
+
+    double t0 = lock_now();
+    group_run(&g, code, len);
+    st->steps += g.steps;
+    st->lane_insts += g.lane_insts;
+    for (int i = 0; ok && i < n; i++) {
+        if (vms[i].halted) {
+            continue;
+        }
+        st->ejected++;
+        um_32_predecode(&vms[i]);
+        if (um_32_run(&vms[i], UINT64_MAX) != RUN_HALTED) {
+            fprintf(stderr, "** %s: the machine Failed\n", inputs[i]);
+            um_32_print_fault(&vms[i]);
+            st->failed++;
+        }
+        st->scalar_insts += vms[i].icount - g.insts[i];
+    }
+    st->seconds += lock_now() - t0;
+
+    for (int i = 0; i < n; i++) {
+        if (ok && !write_output(inputs[i], &mems[i])) {
+            ok = false;
+        }
+        um_32_shutdown(&vms[i]);
+        um_32_io_close(&vms[i].io);
+        free(mems[i].out);
+        free_buffer(ins[i]);
+    }
+    return ok;
+}
+
+// Runs `prog` once per input file, writing each run's output to the input's
+// name plus ".out".
+int um_32_lockstep(Buffer prog, char **inputs, int n)
+{
+    um_32_descriptor.many = 1;
+    size_t len = prog.len / 4;
+    uint32_t *words = xmalloc(sizeof(uint32_t) * (len + 1));
+    Decoded *code = xmalloc(sizeof(Decoded) * (len + 1));
+    for (size_t i = 0; i < len; i++) {
+        const uint8_t *p = prog.data + i * 4;
+        words[i] = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+        code[i] = um_32_decode(words[i]);
+    }
+    code[len] = um_32_decode(TRAP_SENTINEL);
+
+    LockStats st = {0};
+    int status = 0;
+    for (int i = 0; i < n; i += LANES) {
+        if (!lock_group(words, code, len, inputs + i, n - i < LANES ? n - i : LANES, &st)) {
+            status = 1;
+        }
+    }
+    if (st.failed) {
+        status = 1;
+    }
+    uint64_t total = st.lane_insts + st.scalar_insts;
+    fprintf(stderr, "** %d machines, %d ejected: %.1f%% of %llu instructions in lockstep, "
+            "%.1f lanes per issue, %.1f M instructions/s\n",
+            n, st.ejected, total ? 100.0 * st.lane_insts / total : 0,
+            (unsigned long long)total,
+            st.steps ? (double)st.lane_insts / st.steps : 0,
+            st.seconds > 0 ? total / st.seconds / 1e6 : 0);
+    free(words);
+    free(code);
+    return status;
+}
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+
+// A small LZ77 block codec in the spirit of LZ4: a stream of sequences,
+// each a token byte (literal count in the high nibble, match length minus
+// LZ_MIN_MATCH in the low nibble), optional length extension bytes, the
+// literals, and a 16-bit little-endian match offset. The final sequence
+// carries literals only. Machine images are mostly zeros and repeated
+// platters, which this handles at memory speed without an external
+// dependency.
+#define LZ_HASH_BITS  14
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+
+static inline uint32_t lz_load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t lz_compress_bound(size_t len)
+{
+    return len + len / 255 + 16;
+}
+
+static bool lz_put_length(uint8_t *dst, size_t *op, size_t cap, size_t n)
+{
+    while (n >= 255) {
+        if (*op >= cap) {
+            return false;
+        }
+        dst[(*op)++] = 255;
+        n -= 255;
+    }
+    if (*op >= cap) {
+        return false;
+    }
+    dst[(*op)++] = n;
+    return true;
+}
+
+static bool lz_put_sequence(uint8_t *dst, size_t *op, size_t cap,
+                            const uint8_t *lit, size_t nlit,
+                            size_t offset, size_t mlen)
+{
+    if (*op >= cap) {
+        return false;
+    }
+    size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+    dst[(*op)++] = (nlit < 15 ? nlit : 15) << 4 | (mcode < 15 ? mcode : 15);
+    if (nlit >= 15 && !lz_put_length(dst, op, cap, nlit - 15)) {
+        return false;
+    }
+    if (cap - *op < nlit) {
+        return false;
+    }
+    memcpy(dst + *op, lit, nlit);
+    *op += nlit;
+    if (!mlen) {
+        return true;
+    }
+    if (cap - *op < 2) {
+        return false;
+    }
+    dst[(*op)++] = offset & 0xff;
+    dst[(*op)++] = offset >> 8;
+    if (mcode >= 15 && !lz_put_length(dst, op, cap, mcode - 15)) {
+        return false;
+    }
+    return true;
+}
+
+// Returns the compressed size, or 0 if the output would not fit in `cap`.
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+    while (len >= LZ_MIN_MATCH && ip <= len - LZ_MIN_MATCH) {
+        uint32_t seq = lz_load32(src + ip);
+        uint32_t h = lz_hash(seq);
+        size_t ref = table[h];
+        table[h] = ip;
+        if (ref < ip && ip - ref <= LZ_MAX_OFFSET && lz_load32(src + ref) == seq) {
+            size_t mlen = LZ_MIN_MATCH;
+            while (ip + mlen < len && src[ref + mlen] == src[ip + mlen]) {
+                mlen++;
+            }
+            if (!lz_put_sequence(dst, &op, cap, src + anchor, ip - anchor, ip - ref, mlen)) {
+                return 0;
+            }
+            ip += mlen;
+            anchor = ip;
+        } else {
+            // Skip ahead faster through data that isn't compressing.
+            ip += 1 + ((ip - anchor) >> 6);
+        }
+    }
+    if (!lz_put_sequence(dst, &op, cap, src + anchor, len - anchor, 0, 0)) {
+        return 0;
+    }
+    return op;
+}
+
+static bool lz_get_length(const uint8_t *src, size_t len, size_t *ip, size_t *n)
+{
+    uint8_t b;
+    do {
+        if (*ip >= len) {
+            return false;
+        }
+        b = src[(*ip)++];
+        *n += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decodes exactly `out_len` bytes; rejects malformed or truncated input.
+bool lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len)
+{
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !lz_get_length(src, len, &ip, &nlit)) {
+            return false;
+        }
+        if (len - ip < nlit || out_len - op < nlit) {
+            return false;
+        }
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == len) {
+            break;
+        }
+        if (len - ip < 2) {
+            return false;
+        }
+        size_t offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        size_t mlen = token & 0xf;
+        if (mlen == 15 && !lz_get_length(src, len, &ip, &mlen)) {
+            return false;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || out_len - op < mlen) {
+            return false;
+        }
+        const uint8_t *ref = dst + op - offset;
+        if (offset >= mlen) {
+            memcpy(dst + op, ref, mlen);
+        } else if (offset == 1) {
+            memset(dst + op, *ref, mlen);
+        } else {
+            for (size_t i = 0; i < mlen; i++) {
+                dst[op + i] = ref[i];
+            }
+        }
+        op += mlen;
+    }
+    return op == out_len;
+}
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+#include <sys/time.h>
+
+// The um-32 command: everything else is the library, libum-32.a.
+
+static void um_32_print_compact(Machine *vm)
+{
+    CompactStats *st = &vm->compact;
+    if (!st->runs) {
+        fprintf(stderr, "** no compactions\n");
+        return;
+    }
+    // Fragmentation: the share of the region not holding anything live.
+    fprintf(stderr, "** %llu compactions in %.3f s, region %.1f -> %.1f MiB on average, "
+            "fragmentation %.0f%% -> %.0f%%\n",
+            (unsigned long long)st->runs, st->seconds,
+            st->held_before / (double)st->runs / (1 << 20),
+            st->held_after / (double)st->runs / (1 << 20),
+            100 - 100.0 * st->live / st->held_before,
+            100 - 100.0 * st->live / st->held_after);
+}
+
+// What codex prints before the image it unpacks.
+#define DEFAULT_MARKER "UM program follows colon:"
+
+static void usage()
+{
+    fprintf(stderr, "Usage: %s [-x | -s snapshot] [-c ratio] [-z secs] [-e [-m marker]] program\n", program_invocation_name);
+    fprintf(stderr, "       %s [-x | -s snapshot] [-c ratio] [-z secs] [-e [-m marker]] -r snapshot\n", program_invocation_name);
+    fprintf(stderr, "       %s -F [-s snapshot] [-c ratio] [-G file] program|-r snapshot\n", program_invocation_name);
+    fprintf(stderr, "       %s [-E] [-z secs] [-H secs] [-w tenant=weight]... -l port|path program\n", program_invocation_name);
+    fprintf(stderr, "       %s [-P] [-n count] [-c ratio] -b instances program\n", program_invocation_name);
+    fprintf(stderr, "       %s -p program program...\n", program_invocation_name);
+    fprintf(stderr, "       %s -L program input...\n", program_invocation_name);
+    fprintf(stderr, "       %s [-s snapshot] [-c ratio] [-M path] program|-r snapshot|-R path\n", program_invocation_name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -s FILE  write a snapshot to FILE on SIGUSR1\n");
+    fprintf(stderr, "  -r FILE  resume from the snapshot in FILE\n");
+    fprintf(stderr, "  -l ADDR  serve a machine to every client of TCP port or Unix socket ADDR\n");
+    fprintf(stderr, "  -E       with -l, use epoll even if io_uring is available\n");
+    fprintf(stderr, "  -H SECS  with -l, spill sessions idle for SECS seconds to $TMPDIR\n");
+    fprintf(stderr, "  -w T=W   with -l, give tenant T (a peer address, or uid:N) W shares of CPU\n");
+    fprintf(stderr, "  -b N     benchmark 1..N concurrent instances, one per core\n");
+    fprintf(stderr, "  -P       with -b, run instances as processes instead of threads\n");
+    fprintf(stderr, "  -n COUNT with -b, stop each instance after COUNT instructions\n");
+    fprintf(stderr, "  -e       run the program image the program outputs after the marker\n");
+    fprintf(stderr, "  -m TEXT  with -e, the marker (default \"%s\")\n", DEFAULT_MARKER);
+    fprintf(stderr, "  -p       run the programs as a pipeline, each one's output the next one's input\n");
+    fprintf(stderr, "  -L       run the program once per input file, in lockstep, into INPUT.out\n");
+    fprintf(stderr, "  -x       enable the EXT operations on opcode 14 (siblings, counters)\n");
+    fprintf(stderr, "  -c N     compact the heap once it holds N times what was live last time\n");
+    fprintf(stderr, "  -z SECS  compress large arrays left untouched for SECS seconds, and\n");
+    fprintf(stderr, "           store those holding only values below 256 as bytes\n");
+    fprintf(stderr, "  -G FILE  count every jump and write the weighted control-flow graph to FILE\n");
+    fprintf(stderr, "  -F       fuzz the input with AFL: keep its coverage map, fork at the first INPUT\n");
+    fprintf(stderr, "  -M PATH  on SIGUSR2, migrate the machine to the process listening at PATH\n");
+    fprintf(stderr, "  -R PATH  listen at Unix socket PATH for a machine to migrate in, and run it\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *snapshot_path = NULL;
+    const char *restore_path = NULL;
+    const char *listen_addr = NULL;
+    bool force_epoll = false;
+    int bench_instances = 0;
+    bool bench_processes = false;
+    uint64_t bench_limit = 0;
+    bool pipeline = false;
+    Capture capture = {DEFAULT_MARKER};
+    bool boot_output = false;
+    const char *migrate_path = NULL;
+    const char *receive_path = NULL;
+    uint32_t compact_ratio = 0;
+    unsigned cold_secs = 0;
+    unsigned idle_secs = 0;
+    const char *edges_path = NULL;
+    bool fuzz = false;
+    TenantWeight *weights = NULL;
+    int nweights = 0;
+    bool ext = false;
+    bool lockstep = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:l:Eb:Pn:pem:M:R:c:xLz:H:G:Fw:")) != -1) {
+        switch (opt) {
+            case 's':
+                snapshot_path = optarg;
+                break;
+            case 'r':
+                restore_path = optarg;
+                break;
+            case 'l':
+                listen_addr = optarg;
+                break;
+            case 'E':
+                force_epoll = true;
+                break;
+            case 'b':
+                bench_instances = atoi(optarg);
+                if (bench_instances < 1) {
+                    usage();
+                }
+                break;
+            case 'P':
+                bench_processes = true;
+                break;
+            case 'n':
+                bench_limit = strtoull(optarg, NULL, 0);
+                break;
+            case 'p':
+                pipeline = true;
+                break;
+            case 'e':
+                boot_output = true;
+                break;
+            case 'm':
+                if (!*optarg) {
+                    usage();
+                }
+                capture.marker = optarg;
+                break;
+            case 'M':
+                migrate_path = optarg;
+                break;
+            case 'R':
+                receive_path = optarg;
+                break;
+            case 'x':
+                ext = true;
+                break;
+            case 'L':
+                lockstep = true;
+                break;
+            case 'c':
+                compact_ratio = atoi(optarg);
+                if (compact_ratio < 2) {
+                    usage();
+                }
+                break;
+            case 'z':
+                cold_secs = atoi(optarg);
+                if (cold_secs < 1) {
+                    usage();
+                }
+                break;
+            case 'H':
+                idle_secs = atoi(optarg);
+                if (idle_secs < 1) {
+                    usage();
+                }
+                break;
+            case 'G':
+                edges_path = optarg;
+                break;
+            case 'F':
+                fuzz = true;
+                break;
+            case 'w':
+                {
+                    char *eq = strrchr(optarg, '=');
+                    int weight = eq ? atoi(eq + 1) : 0;
+                    if (!eq || eq == optarg || weight < 1) {
+                        usage();
+                    }
+                    *eq = '\0';
+                    weights = xrealloc(weights, sizeof(TenantWeight) * (nweights + 1));
+                    weights[nweights++] = (TenantWeight){optarg, weight};
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    if (pipeline) {
+        if (argc - optind < 1 || snapshot_path || restore_path || listen_addr ||
+            bench_instances || boot_output || migrate_path || receive_path || compact_ratio ||
+            ext || lockstep || cold_secs || idle_secs || edges_path || fuzz || nweights) {
+            usage();
+        }
+        int n = argc - optind;
+        Buffer *progs = xcalloc(n, sizeof(Buffer));
+        for (int i = 0; i < n; i++) {
+            FILE *f = fopen(argv[optind + i], "r");
+            if (!f) {
+                perror(argv[optind + i]);
+                return 1;
+            }
+            progs[i] = read_entire_file(f);
+            fclose(f);
+        }
+        int status = um_32_pipeline(progs, n);
+        for (int i = 0; i < n; i++) {
+            free_buffer(progs[i]);
+        }
+        free(progs);
+        return status;
+    }
+    if (lockstep) {
+        if (argc - optind < 2 || snapshot_path || restore_path || listen_addr ||
+            bench_instances || boot_output || migrate_path || receive_path || compact_ratio ||
+            ext || cold_secs || idle_secs || edges_path || fuzz || nweights) {
+            usage();
+        }
+        FILE *f = fopen(argv[optind], "r");
+        if (!f) {
+            perror(argv[optind]);
+            return 1;
+        }
+        Buffer prog = read_entire_file(f);
+        fclose(f);
+        int status = um_32_lockstep(prog, argv + optind + 1, argc - optind - 1);
+        free_buffer(prog);
+        return status;
+    }
+    bool from_elsewhere = restore_path || receive_path;
+    if (argc - optind != (from_elsewhere ? 0 : 1) || (restore_path && receive_path) ||
+        (listen_addr && from_elsewhere) ||
+        (bench_instances && (listen_addr || from_elsewhere || cold_secs)) ||
+        (boot_output && (listen_addr || bench_instances)) ||
+        (compact_ratio && listen_addr) ||
+        ((idle_secs || nweights) && !listen_addr) ||
+        // A profile is of one program, run to the end here.
+        (edges_path && (listen_addr || bench_instances || boot_output || migrate_path)) ||
+        // Every execution is a fork of this one process, on its console.
+        (fuzz && (listen_addr || bench_instances || boot_output || migrate_path ||
+                  receive_path || ext || cold_secs)) ||
+        // A machine with siblings can be neither saved nor moved.
+        (ext && (listen_addr || bench_instances || snapshot_path || migrate_path ||
+                 receive_path)) ||
+        ((migrate_path || receive_path) && (listen_addr || bench_instances || boot_output))) {
+        usage();
+    }
+
+    Machine vm = {0};
+    if (receive_path) {
+        // The machine arrives with its console.
+        if (!um_32_migrate_in(&vm, receive_path)) {
+            perror("receiving machine");
+            return 1;
+        }
+    } else if (restore_path) {
+        if (!um_32_snapshot_load(&vm, restore_path)) {
+            perror("restoring snapshot");
+            return 1;
+        }
+    } else {
+        FILE *f = fopen(argv[optind], "r");
+        if (!f) {
+            perror("opening program file");
+            return 1;
+        }
+        Buffer prog = read_entire_file(f);
+        fclose(f);
+
+        if (listen_addr) {
+            return um_32_host(prog, listen_addr, force_epoll, cold_secs, idle_secs,
+                              weights, nweights);
+        }
+        if (bench_instances) {
+            return um_32_bench(prog, bench_instances, bench_processes, bench_limit,
+                    compact_ratio);
+        }
+        um_32_init(&vm, prog);
+#if 0
+        fprintf(stderr, "** UM-32 initialized, program %lu bytes.\n", prog.len);
+#endif
+        free_buffer(prog);
+    }
+    if (snapshot_path) {
+        vm.snapshot_path = snapshot_path;
+        struct sigaction sa = {0};
+        sa.sa_handler = um_32_request_snapshot;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+    if (compact_ratio) {
+        vm.compact_ratio = compact_ratio;
+        vm.compact_at = COMPACT_MIN_HELD;
+    }
+    vm.ext = ext;
+    if (edges_path) {
+        vm.edges = um_32_edges_new();
+    }
+    if (fuzz) {
+        um_32_fuzz_start(&vm);
+    }
+    if (cold_secs) {
+        um_32_cold_start(&vm);
+        // No SA_RESTART: a machine idle at INPUT is the one to sweep.
+        struct sigaction sa = {0};
+        sa.sa_handler = um_32_request_chill;
+        sigaction(SIGALRM, &sa, NULL);
+        struct itimerval it = {{cold_secs, 0}, {cold_secs, 0}};
+        setitimer(ITIMER_REAL, &it, NULL);
+    }
+    if (migrate_path) {
+        vm.migrate_path = migrate_path;
+        // No SA_RESTART: a machine waiting for input has to be woken to go.
+        struct sigaction sa = {0};
+        sa.sa_handler = um_32_request_migrate;
+        sigaction(SIGUSR2, &sa, NULL);
+    }
+    IoBackend console;
+    if (receive_path) {
+        console = vm.io;
+    } else {
+        um_32_io_fd(&console, STDIN_FILENO, STDOUT_FILENO);
+    }
+    if (boot_output) {
+        um_32_io_capture(&vm.io, &console, &capture);
+    } else if (fuzz) {
+        um_32_io_fuzz(&vm.io, &console, &vm);
+    } else {
+        vm.io = console;
+    }
+    um_32_spin_cycle(&vm);
+    if (compact_ratio) {
+        um_32_print_compact(&vm);
+    }
+    if (cold_secs) {
+        um_32_print_cold(&vm.cold_stats);
+    }
+    if (edges_path) {
+        if (!um_32_edges_write(vm.edges, edges_path)) {
+            perror(edges_path);
+        }
+        um_32_edges_free(vm.edges);
+    }
+    if (fuzz) {
+        um_32_fuzz_stop(&vm);
+    }
+    um_32_shutdown(&vm);
+    if (boot_output) {
+        um_32_io_close(&vm.io);
+        if (capture.active) {
+            if (capture.npartial) {
+                fprintf(stderr, "** ignoring %d bytes after the last platter\n",
+                        capture.npartial);
+            }
+            // The image takes over the console, and with it any input the
+            // first program had read ahead.
+            Machine next = {0};
+            um_32_init_words(&next, capture.words, capture.len);
+            free(capture.words);
+            next.snapshot_path = snapshot_path;
+            next.compact_ratio = compact_ratio;
+            next.compact_at = COMPACT_MIN_HELD;
+            next.ext = ext;
+            if (cold_secs) {
+                um_32_cold_start(&next);
+            }
+            next.io = console;
+            um_32_spin_cycle(&next);
+            if (compact_ratio) {
+                um_32_print_compact(&next);
+            }
+            if (cold_secs) {
+                um_32_print_cold(&next.cold_stats);
+            }
+            um_32_shutdown(&next);
+            console = next.io;
+        }
+    } else if (fuzz) {
+        um_32_io_close(&vm.io);
+    } else {
+        console = vm.io;
+    }
+    um_32_io_close(&console);
+
+    return 0;
+}
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// Live migration: a running machine is streamed over a Unix socket to
+// another process, which picks it up where it left off.
+//
+// Array identifiers are never reused (ALLOC always appends), so an array
+// is known by its identifier alone. The sender first copies every array
+// while the machine keeps running, then repeatedly copies the arrays
+// written since the previous round, and only stops the machine for the
+// last, small round. Each pre-copy round is streamed by a forked child,
+// which sees the arrays frozen as they were at the fork while the parent
+// goes on running the machine and marking what it writes in vm->dirty.
+//
+// Stream (host byte order; both ends are on the same host):
+//
+//   MigHeader
+//   MigRecord MIG_ARRAY + len platters      any number, later ones win
+//   MigRecord MIG_FINAL + MigFinal          carries the console fds
+//     uint8_t active[memarr_count]
+//     pending output bytes, pending input bytes
+//
+// and the receiver answers with a single byte once it has the machine.
+#define MIG_MAGIC       "UM32MIGR"
+#define MIG_VERSION     1
+#define MIG_BYTE_ORDER  0x01020304
+#define MIG_MAX_ROUNDS  8
+#define MIG_FINAL_BYTES (1 << 20)     // dirty data small enough to stop for
+#define MIG_SLICE       (1 << 22)     // instructions run between checks
+#define MIG_MAX_ID      (UINT32_MAX / 2)  // highest id the table can grow to
+
+enum {
+    MIG_ARRAY = 1,
+    MIG_FINAL = 2,
+};
+
+typedef struct MigHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+} MigHeader;
+
+typedef struct MigRecord {
+    uint32_t type;
+    uint32_t id;
+    uint32_t len;
+    uint32_t pad;
+} MigRecord;
+
+typedef struct MigFinal {
+    uint32_t PC;
+    uint32_t R[8];
+    uint32_t memarr_count;
+    uint32_t out_len;
+    uint32_t in_len;
+} MigFinal;
+
+// Collects the active arrays marked dirty and clears their marks.
+static size_t mig_take_dirty(Machine *vm, uint32_t *ids, size_t *bytes)
+{
+    size_t n = 0;
+    *bytes = 0;
+    for (uint32_t i = 0; i < vm->memarr_count; i++) {
+        if (vm->dirty[i] && vm->M[i].active) {
+            ids[n++] = i;
+            *bytes += vm->M[i].len * 4;
+        }
+        vm->dirty[i] = 0;
+    }
+    return n;
+}
+
+// Safe in a forked child: no allocation, just writes.
+static bool mig_send_arrays(Machine *vm, int sock, const uint32_t *ids, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        Mem *m = &vm->M[ids[i]];
+        MigRecord rec = {MIG_ARRAY, ids[i], m->len, 0};
+        if (!write_all(sock, &rec, sizeof(rec)) ||
+            !write_all(sock, m->inst, (size_t)m->len * 4)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs the machine in slices until `child` has finished its round, or the
+// machine has nothing left to do for now. Returns false if the round
+// failed or the machine stopped for good.
+static bool mig_run_during(Machine *vm, pid_t child, RunStatus *status)
+{
+    int ws;
+    pid_t done = 0;
+    while (*status != RUN_BLOCKED && (done = waitpid(child, &ws, WNOHANG)) == 0) {
+        *status = um_32_run(vm, MIG_SLICE);
+        if (*status == RUN_HALTED || *status == RUN_FAILED) {
+            waitpid(child, &ws, 0);
+            return false;
+        }
+    }
+    if (done == 0) {
+        // Idle, waiting for input: nothing more will be dirtied.
+        while ((done = waitpid(child, &ws, 0)) < 0 && errno == EINTR) {
+        }
+    }
+    return done == child && WIFEXITED(ws) && WEXITSTATUS(ws) == 0;
+}
+
+static bool mig_send_final(Machine *vm, int sock, int in_fd, int out_fd)
+{
+    MigRecord rec = {MIG_FINAL, 0, 0, 0};
+    MigFinal fin = {0};
+    fin.PC = vm->PC;
+    memcpy(fin.R, vm->R, sizeof(fin.R));
+    fin.memarr_count = vm->memarr_count;
+    fin.out_len = vm->out_ptr - vm->out_base;
+    fin.in_len = vm->in_end - vm->in_ptr;
+
+    // The console goes along with the record, so the receiver talks to
+    // the same terminal, pipe or socket.
+    struct iovec iov[2] = {{&rec, sizeof(rec)}, {&fin, sizeof(fin)}};
+    int fds[2] = {in_fd, out_fd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    if (n != sizeof(rec) + sizeof(fin)) {
+        return false;
+    }
+
+    uint8_t *active = xmalloc(vm->memarr_count);
+    for (uint32_t i = 0; i < vm->memarr_count; i++) {
+        active[i] = vm->M[i].active;
+    }
+    bool ok = write_all(sock, active, vm->memarr_count) &&
+              write_all(sock, vm->out_base, fin.out_len) &&
+              write_all(sock, vm->in_ptr, fin.in_len);
+    free(active);
+    return ok;
+}
+
+// Streams the machine to `sock`, running it between pre-copy rounds. On
+// success the machine belongs to the receiver and must not be run again;
+// on failure it carries on here. `status` is how the machine last
+// stopped, which the caller must act on if it halted or Failed.
+bool um_32_migrate_send(Machine *vm, int sock, int in_fd, int out_fd, RunStatus *status)
+{
+    *status = RUN_YIELDED;
+    // A receiver that goes away is a failed migration, not a dead sender.
+    struct sigaction ign = {0}, pipe_sa;
+    ign.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ign, &pipe_sa);
+    // The machine must not sit in a read while it is being moved.
+    bool nonblock = um_32_io_fd_nonblock(&vm->io, true);
+    // Pre-copy goes by `active`, which sweeps would meddle with.
+    bool cold = vm->cold != NULL;
+    um_32_cold_stop(vm);
+    vm->dirty = xmalloc(vm->memarr_cap);
+    memset(vm->dirty, 1, vm->memarr_cap);
+    uint32_t *ids = NULL;
+    bool ok;
+
+    MigHeader h = {{0}};
+    memcpy(h.magic, MIG_MAGIC, 8);
+    h.version = MIG_VERSION;
+    h.byte_order = MIG_BYTE_ORDER;
+    ok = write_all(sock, &h, sizeof(h));
+
+    size_t last = SIZE_MAX;
+    for (int round = 0; ok && round < MIG_MAX_ROUNDS; round++) {
+        size_t bytes;
+        ids = xrealloc(ids, sizeof(uint32_t) * (vm->memarr_count + 1));
+        size_t n = mig_take_dirty(vm, ids, &bytes);
+        // Stop once what is left is small, or no longer shrinking.
+        if (round > 0 && (bytes <= MIG_FINAL_BYTES || bytes >= last)) {
+            for (size_t i = 0; i < n; i++) {
+                vm->dirty[ids[i]] = 1;
+            }
+            break;
+        }
+        last = bytes;
+        pid_t child = fork();
+        if (child < 0) {
+            ok = false;
+            break;
+        }
+        if (child == 0) {
+            _exit(mig_send_arrays(vm, sock, ids, n) ? 0 : 1);
+        }
+        ok = mig_run_during(vm, child, status);
+    }
+
+    if (ok) {
+        // Stop-and-copy: the machine doesn't run again here.
+        size_t bytes;
+        ids = xrealloc(ids, sizeof(uint32_t) * (vm->memarr_count + 1));
+        size_t n = mig_take_dirty(vm, ids, &bytes);
+        char ack;
+        ok = mig_send_arrays(vm, sock, ids, n) &&
+             mig_send_final(vm, sock, in_fd, out_fd) &&
+             read_all(sock, &ack, 1);
+    }
+    free(ids);
+    free(vm->dirty);
+    vm->dirty = NULL;
+    if (nonblock) {
+        um_32_io_fd_nonblock(&vm->io, false);
+    }
+    if (cold && !ok) {
+        um_32_cold_start(vm);
+    }
+    sigaction(SIGPIPE, &pipe_sa, NULL);
+    return ok;
+}
+
+// Grows the array table to hold `id`; fails if it is too high for the
+// table to double to.
+static bool mig_reserve(Machine *vm, uint32_t id)
+{
+    if (id > MIG_MAX_ID) {
+        return false;
+    }
+    if (!vm->M) {
+        vm->memarr_cap = 64;
+        vm->M = region_calloc(&vm->region, sizeof(Mem) * vm->memarr_cap);
+    }
+    if (id < vm->memarr_cap) {
+        return true;
+    }
+    uint32_t cap = vm->memarr_cap;
+    while (cap <= id) {
+        cap *= 2;
+    }
+    Mem *table = region_calloc(&vm->region, sizeof(Mem) * cap);
+    memcpy(table, vm->M, sizeof(Mem) * vm->memarr_cap);
+    region_free(&vm->region, vm->M, sizeof(Mem) * vm->memarr_cap);
+    vm->M = table;
+    vm->memarr_cap = cap;
+    return true;
+}
+
+static void mig_free_array(Machine *vm, uint32_t id)
+{
+    Mem *m = &vm->M[id];
+    if (m->inst) {
+        region_free(&vm->region, m->inst, (size_t)(id == 0 ? m->len + 1 : m->len) * 4);
+    }
+    *m = (Mem){0};
+}
+
+static bool mig_recv_array(Machine *vm, int sock, const MigRecord *rec)
+{
+    if (!mig_reserve(vm, rec->id)) {
+        return false;
+    }
+    Mem *m = &vm->M[rec->id];
+    if (m->inst && m->len != rec->len) {
+        mig_free_array(vm, rec->id);
+    }
+    if (!m->inst) {
+        m->inst = rec->id == 0 ? um_32_alloc_program(vm, rec->len)
+                               : region_alloc(&vm->region, (size_t)rec->len * 4);
+        m->len = rec->len;
+    }
+    m->active = true;
+    if (rec->id >= vm->memarr_count) {
+        vm->memarr_count = rec->id + 1;
+    }
+    return read_all(sock, m->inst, (size_t)rec->len * 4);
+}
+
+// Receives the final record and the console fds that come with it.
+static bool mig_recv_final(Machine *vm, int sock, MigFinal *fin, int fds[2])
+{
+    MigRecord rec;
+    struct iovec iov[2] = {{&rec, sizeof(rec)}, {fin, sizeof(*fin)}};
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(rec) + sizeof(*fin) || rec.type != MIG_FINAL || !cmsg ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2)) {
+        return false;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 2);
+    return true;
+}
+
+// Receives a machine into a fresh Machine and connects it to the console
+// it had. The caller runs it.
+bool um_32_migrate_recv(Machine *vm, int sock)
+{
+    MigHeader h;
+    if (!read_all(sock, &h, sizeof(h)) || memcmp(h.magic, MIG_MAGIC, 8) != 0 ||
+        h.version != MIG_VERSION || h.byte_order != MIG_BYTE_ORDER) {
+        errno = EINVAL;
+        return false;
+    }
+    MigFinal fin;
+    int fds[2];
+    for (;;) {
+        // Peek at the record type: the final record has to be received
+        // with recvmsg to get its fds.
+        MigRecord rec;
+        ssize_t n;
+        while ((n = recv(sock, &rec, sizeof(rec), MSG_PEEK | MSG_WAITALL)) < 0 &&
+               errno == EINTR) {
+        }
+        if (n != sizeof(rec)) {
+            errno = EPIPE;
+            return false;
+        }
+        if (rec.type == MIG_FINAL) {
+            if (!mig_recv_final(vm, sock, &fin, fds)) {
+                errno = EINVAL;
+                return false;
+            }
+            break;
+        }
+        if (rec.type != MIG_ARRAY || !read_all(sock, &rec, sizeof(rec)) ||
+            !mig_recv_array(vm, sock, &rec)) {
+            errno = EINVAL;
+            return false;
+        }
+    }
+
+    if (fin.memarr_count < vm->memarr_count || fin.memarr_count == 0 ||
+        !mig_reserve(vm, fin.memarr_count - 1)) {
+        errno = EINVAL;
+        return false;
+    }
+    uint8_t *active = xmalloc((size_t)fin.memarr_count + 1);
+    uint8_t *out = xmalloc((size_t)fin.out_len + 1);
+    uint8_t *in = xmalloc((size_t)fin.in_len + 1);
+    bool ok = read_all(sock, active, fin.memarr_count) &&
+              read_all(sock, out, fin.out_len) &&
+              read_all(sock, in, fin.in_len);
+    if (ok) {
+        vm->memarr_count = fin.memarr_count;
+        for (uint32_t i = 0; i < fin.memarr_count; i++) {
+            if (!active[i]) {
+                mig_free_array(vm, i);
+            } else if (!vm->M[i].active) {
+                ok = false;
+            }
+        }
+        ok = ok && vm->M[0].active && fin.PC <= vm->M[0].len;
+    }
+    if (ok) {
+        vm->PC = fin.PC;
+        memcpy(vm->R, fin.R, sizeof(vm->R));
+        vm->halted = false;
+        um_32_predecode(vm);
+        um_32_io_fd(&vm->io, fds[0], fds[1]);
+        ok = write_all(fds[1], out, fin.out_len) &&
+             um_32_io_fd_preload(&vm->io, in, fin.in_len);
+    }
+    free(active);
+    free(out);
+    free(in);
+    char ack = 1;
+    if (!ok || !write_all(sock, &ack, 1)) {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+static bool mig_address(struct sockaddr_un *sa, const char *path)
+{
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa->sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(sa->sun_path, path);
+    return true;
+}
+
+// Migrates a console machine to the process listening at `path`.
+bool um_32_migrate_out(Machine *vm, const char *path, RunStatus *status)
+{
+    *status = RUN_YIELDED;
+    struct sockaddr_un sa;
+    if (!mig_address(&sa, path)) {
+        return false;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return false;
+    }
+    if (connect(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(sock);
+        return false;
+    }
+    bool ok = um_32_migrate_send(vm, sock, STDIN_FILENO, STDOUT_FILENO, status);
+    close(sock);
+    return ok;
+}
+
+// Waits at `path` for one machine to migrate in.
+bool um_32_migrate_in(Machine *vm, const char *path)
+{
+    struct sockaddr_un sa;
+    if (!mig_address(&sa, path)) {
+        return false;
+    }
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        return false;
+    }
+    unlink(path);
+    if (bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(lfd, 1) < 0) {
+        close(lfd);
+        return false;
+    }
+    int sock;
+    while ((sock = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    close(lfd);
+    unlink(path);
+    if (sock < 0) {
+        return false;
+    }
+    bool ok = um_32_migrate_recv(vm, sock);
+    close(sock);
+    return ok;
+}
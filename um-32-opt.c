@@ -0,0 +1,1172 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+
+// Offline UM-to-UM rewriter: reads a program image and writes one that
+// any UM runs with the same observable behaviour, in fewer instructions.
+//
+// Every word stays at its address, so nothing needs relocating. A forward
+// analysis tracks each register as a small set of possible constants, or
+// failing that a range, and finds which words can run, where each
+// LOAD_PROG 0 can go, and which words of array 0 are read or amended as
+// data. A jump whose target register is a CMOV of two constants tells the
+// analysis which way the condition went, which is what keeps a loop
+// counter in range. What cannot be pinned down only costs the words it
+// touches: an access at an unknown offset takes every word from the range
+// the offset is in, a jump through a computed register may land on any
+// word, and a word amended before it runs may be any instruction at all.
+// Words read or amended as data are never changed, and the rest is
+// rewritten:
+//
+//  - instructions whose result is one known constant become ORTHOG;
+//  - register writes nothing reads are replaced by no-ops;
+//  - jumps to a block that only jumps on are sent straight to the end of
+//    the chain;
+//  - long runs of no-ops are jumped over;
+//  - words that can never run are zeroed, and trimmed off the end.
+//
+// A program that can use array 0 past its end is left as it is: it is
+// most likely the front of an image with more appended to it.
+
+#define OPT_SET_MAX 4
+#define OPT_NOP 0x00000000      // CMOV r0 r0 r0
+#define OPT_SKIP_MIN 8          // no-ops worth replacing by a 3-word jump
+#define OPT_THREAD_ROUNDS 16
+#define OPT_LOAD_MAX 256        // widest range of array 0 an index is read from
+
+typedef enum ValKind {
+    VAL_SET,        // one of n known constants
+    VAL_RANGE,      // from v[0] to v[1], inclusive
+    VAL_NONZERO,    // unknown, but not 0 (e.g. an array identifier)
+    VAL_TOP,        // unknown
+} ValKind;
+
+typedef struct Val {
+    uint8_t kind;
+    uint8_t n;
+    uint32_t v[OPT_SET_MAX];
+} Val;
+
+typedef struct State {
+    Val r[8];
+    bool dirty;             // array 0 may have been amended on the way here
+    bool guarded;           // r[gsel] is gzero if r[gcond] is 0, else gnz
+    uint8_t gsel, gcond;
+    uint32_t gzero, gnz;
+} State;
+
+enum {
+    W_REACHED = 1 << 0,     // can be executed
+    W_TARGET  = 1 << 1,     // entered by a jump
+    W_READ    = 1 << 2,     // read as data by ARRAY_INDEX
+    W_WRITTEN = 1 << 3,     // written by ARRAY_AMEND
+    W_QUEUED  = 1 << 4,     // on the analysis worklist
+    W_UNKNOWN = 1 << 5,     // amended before it can run: anything at all
+    W_AMENDED = 1 << 6,     // taken to be amended, so not to be read as known
+};
+
+typedef struct Opt {
+    uint32_t *w;
+    size_t len;
+    State *in;              // register state on entry to each word
+    uint8_t *flags;
+    uint8_t *live;          // registers live on entry to each word
+    size_t *work;
+    size_t nwork;
+    bool marking;           // opt_step records what it touches in array 0
+    bool read_all;          // array 0 is read at an unknown offset
+    bool written_all;       // ... or amended at one
+    const char *bail;       // why the program can't be rewritten
+} Opt;
+
+// Where control can go after a word.
+typedef struct Succ {
+    bool fall;              // to the next word
+    bool leave;             // into another program; every register is live
+    bool any;               // to anywhere in array 0
+    uint32_t tab, ntab;     // to what array 0 holds at tab, tab + 1, ...
+    uint8_t n;              // jumps within array 0
+    uint32_t t[OPT_SET_MAX];
+} Succ;
+
+static inline uint32_t op_of(uint32_t w) { return w >> 28; }
+static inline uint32_t ra(uint32_t w) { return (w >> 6) & 7; }
+static inline uint32_t rb(uint32_t w) { return (w >> 3) & 7; }
+static inline uint32_t rc(uint32_t w) { return w & 7; }
+
+static inline uint32_t orthog(uint32_t a, uint32_t v)
+{
+    return (uint32_t)ORTHOG << 28 | a << 25 | v;
+}
+
+static inline uint32_t instr(uint32_t op, uint32_t a, uint32_t b, uint32_t c)
+{
+    return op << 28 | a << 6 | b << 3 | c;
+}
+
+static inline bool is_nop(uint32_t w)
+{
+    return op_of(w) == CMOV && ra(w) == rb(w);
+}
+
+static Val val_const(uint32_t v)
+{
+    Val x = {VAL_SET, 1, {v}};
+    return x;
+}
+
+static Val val_of(ValKind kind)
+{
+    Val x = {kind, 0, {0}};
+    return x;
+}
+
+static Val val_range(uint32_t lo, uint32_t hi)
+{
+    if (lo == hi) {
+        return val_const(lo);
+    }
+    if (lo == 0 && hi == UINT32_MAX) {
+        return val_of(VAL_TOP);
+    }
+    Val x = {VAL_RANGE, 0, {lo, hi}};
+    return x;
+}
+
+// The smallest and largest value x can have.
+static void val_bounds(const Val *x, uint32_t *lo, uint32_t *hi)
+{
+    switch (x->kind) {
+        case VAL_SET:
+            *lo = *hi = x->v[0];
+            for (int i = 1; i < x->n; i++) {
+                *lo = x->v[i] < *lo ? x->v[i] : *lo;
+                *hi = x->v[i] > *hi ? x->v[i] : *hi;
+            }
+            break;
+        case VAL_RANGE:
+            *lo = x->v[0];
+            *hi = x->v[1];
+            break;
+        default:
+            *lo = x->kind == VAL_NONZERO;
+            *hi = UINT32_MAX;
+            break;
+    }
+}
+
+static bool val_eq(const Val *x, const Val *y)
+{
+    int n = x->kind == VAL_RANGE ? 2 : x->n;
+    return x->kind == y->kind && x->n == y->n &&
+           memcmp(x->v, y->v, sizeof(uint32_t) * n) == 0;
+}
+
+static bool val_single(const Val *x, uint32_t *v)
+{
+    if (x->kind == VAL_SET && x->n == 1) {
+        *v = x->v[0];
+        return true;
+    }
+    return false;
+}
+
+static bool val_may_zero(const Val *x)
+{
+    if (x->kind == VAL_RANGE) {
+        return x->v[0] == 0;
+    }
+    if (x->kind != VAL_SET) {
+        return x->kind == VAL_TOP;
+    }
+    for (int i = 0; i < x->n; i++) {
+        if (x->v[i] == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool val_may_nonzero(const Val *x)
+{
+    if (x->kind != VAL_SET) {
+        return true;
+    }
+    for (int i = 0; i < x->n; i++) {
+        if (x->v[i] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Adds v to a set, which becomes the range around it once it holds too
+// many constants.
+static void val_add(Val *x, uint32_t v)
+{
+    for (int i = 0; i < x->n; i++) {
+        if (x->v[i] == v) {
+            return;
+        }
+    }
+    if (x->n < OPT_SET_MAX) {
+        x->v[x->n++] = v;
+        return;
+    }
+    uint32_t lo, hi;
+    val_bounds(x, &lo, &hi);
+    *x = val_range(v < lo ? v : lo, v > hi ? v : hi);
+}
+
+// Joins y into x; returns whether x changed. If `widen`, a range that has
+// to grow goes straight to the limit on that side, so that a loop counter
+// settles in a few rounds rather than one per iteration. The lower limit
+// is 1 while 0 is not in range: a loop counting down to 0 stops there.
+static bool val_join(Val *x, const Val *y, bool widen)
+{
+    Val old = *x;
+    if (x->kind == VAL_TOP || y->kind == VAL_TOP) {
+        *x = val_of(VAL_TOP);
+    } else if (x->kind == VAL_NONZERO || y->kind == VAL_NONZERO) {
+        *x = val_of(val_may_zero(x) || val_may_zero(y) ? VAL_TOP : VAL_NONZERO);
+    } else if (x->kind == VAL_SET && y->kind == VAL_SET) {
+        for (int i = 0; i < y->n && x->kind == VAL_SET; i++) {
+            val_add(x, y->v[i]);
+        }
+        if (x->kind == VAL_RANGE) {
+            val_join(x, y, widen);
+        }
+    } else {
+        uint32_t xlo, xhi, ylo, yhi;
+        val_bounds(x, &xlo, &xhi);
+        val_bounds(y, &ylo, &yhi);
+        uint32_t lo = ylo < xlo ? ylo : xlo, hi = yhi > xhi ? yhi : xhi;
+        if (widen && x->kind == VAL_RANGE) {
+            lo = lo < xlo ? lo != 0 : lo;
+            hi = hi > xhi ? UINT32_MAX : hi;
+        }
+        *x = val_range(lo, hi);
+    }
+    return !val_eq(x, &old);
+}
+
+// Narrows x to the values it can have if it is (or is not) zero; false if
+// it cannot be.
+static bool val_refine(Val *x, bool zero)
+{
+    if (zero) {
+        if (!val_may_zero(x)) {
+            return false;
+        }
+        *x = val_const(0);
+        return true;
+    }
+    if (!val_may_nonzero(x)) {
+        return false;
+    }
+    switch (x->kind) {
+        case VAL_SET:
+            for (int i = 0; i < x->n; i++) {
+                if (x->v[i] == 0) {
+                    x->v[i--] = x->v[--x->n];
+                }
+            }
+            break;
+        case VAL_RANGE:
+            *x = val_range(x->v[0] ? x->v[0] : 1, x->v[1]);
+            break;
+        case VAL_TOP:
+            *x = val_of(VAL_NONZERO);
+            break;
+    }
+    return true;
+}
+
+// Narrows x to its values below n, if it has any.
+static void val_below(Val *x, uint32_t n)
+{
+    uint32_t lo, hi;
+    val_bounds(x, &lo, &hi);
+    if (hi < n || lo >= n) {
+        return;
+    }
+    if (x->kind != VAL_SET) {
+        *x = val_range(lo, n - 1);
+        return;
+    }
+    for (int i = 0; i < x->n; i++) {
+        if (x->v[i] >= n) {
+            x->v[i--] = x->v[--x->n];
+        }
+    }
+}
+
+static Val val_binop(uint32_t op, const Val *x, const Val *y)
+{
+    uint32_t k;
+    if (op == ADD && x->kind == VAL_RANGE && val_single(y, &k)) {
+        // A range moved by k stays one as long as it doesn't wrap midway.
+        uint32_t lo = x->v[0] + k, hi = x->v[1] + k;
+        return lo <= hi ? val_range(lo, hi) : val_of(VAL_TOP);
+    }
+    if (op == ADD && y->kind == VAL_RANGE && x->kind == VAL_SET) {
+        return val_binop(op, y, x);
+    }
+    if (x->kind != VAL_SET || y->kind != VAL_SET) {
+        // What a decoder does: shift right, mask, complement.
+        uint32_t lo, hi;
+        val_bounds(x, &lo, &hi);
+        if (op == DIV && val_single(y, &k) && k != 0) {
+            return val_range(lo / k, hi / k);
+        }
+        if (op == NAND && (val_single(y, &k) || val_single(x, &k))) {
+            return val_range(~k, UINT32_MAX);
+        }
+        if (op == NAND && x == y) {
+            return val_range(~hi, ~lo);
+        }
+        return val_of(VAL_TOP);
+    }
+    Val r = {VAL_SET, 0, {0}};
+    for (int i = 0; i < x->n; i++) {
+        for (int j = 0; j < y->n; j++) {
+            uint32_t p = x->v[i], q = y->v[j];
+            switch (op) {
+                case ADD:
+                    val_add(&r, p + q);
+                    break;
+                case MUL:
+                    val_add(&r, p * q);
+                    break;
+                case DIV:
+                    // Division by zero Fails; it produces nothing.
+                    if (q != 0) {
+                        val_add(&r, p / q);
+                    }
+                    break;
+                case NAND:
+                    val_add(&r, ~(p & q));
+                    break;
+            }
+        }
+    }
+    return r.kind == VAL_SET && r.n == 0 ? val_of(VAL_TOP) : r;
+}
+
+// The value an instruction leaves in its destination, if it has exactly
+// one. ARRAY_INDEX of an array 0 word nothing amends is a constant too.
+static bool opt_result(Opt *o, size_t pc, uint32_t *v)
+{
+    uint32_t w = o->w[pc];
+    const State *s = &o->in[pc];
+    uint32_t op = op_of(w);
+    Val r;
+    switch (op) {
+        case ADD:
+        case MUL:
+        case DIV:
+        case NAND:
+            r = val_binop(op, &s->r[rb(w)], &s->r[rc(w)]);
+            return val_single(&r, v);
+        case CMOV:
+            if (is_nop(w)) {
+                return false;
+            }
+            if (!val_may_zero(&s->r[rc(w)])) {
+                return val_single(&s->r[rb(w)], v);
+            }
+            if (!val_may_nonzero(&s->r[rc(w)])) {
+                return val_single(&s->r[ra(w)], v);
+            }
+            r = s->r[ra(w)];
+            val_join(&r, &s->r[rb(w)], false);
+            return val_single(&r, v);
+        case ARRAY_INDEX:
+            {
+                uint32_t arr, off;
+                if (val_single(&s->r[rb(w)], &arr) && arr == 0 &&
+                    val_single(&s->r[rc(w)], &off) && off < o->len &&
+                    !(o->flags[off] & W_WRITTEN)) {
+                    *v = o->w[off];
+                    return true;
+                }
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+static uint8_t opt_uses(uint32_t w, uint8_t *defs)
+{
+    uint8_t a = 1 << ra(w), b = 1 << rb(w), c = 1 << rc(w);
+    *defs = 0;
+    switch (op_of(w)) {
+        case CMOV:
+            // The old value survives a false condition.
+            return is_nop(w) ? 0 : a | b | c;
+        case ARRAY_INDEX:
+            *defs = a;
+            return b | c;
+        case ARRAY_AMEND:
+            return a | b | c;
+        case ADD:
+        case MUL:
+        case DIV:
+        case NAND:
+            *defs = a;
+            return b | c;
+        case ALLOC:
+            *defs = b;
+            return c;
+        case ABANDON:
+        case OUTPUT:
+            return c;
+        case INPUT:
+            *defs = c;
+            return 0;
+        case LOAD_PROG:
+            return b | c;
+        case ORTHOG:
+            *defs = 1 << ((w >> 25) & 7);
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+// Records an access to array 0 at `off`.
+static void opt_mark(Opt *o, const Val *off, bool amend)
+{
+    uint8_t flag = amend ? W_WRITTEN : W_READ;
+    if (off->kind == VAL_SET) {
+        for (int i = 0; i < off->n; i++) {
+            if (off->v[i] < o->len) {
+                o->flags[off->v[i]] |= flag;
+            }
+        }
+        return;
+    }
+    uint32_t lo, hi;
+    val_bounds(off, &lo, &hi);
+    if (lo == 0 && hi >= o->len - 1) {
+        *(amend ? &o->written_all : &o->read_all) = true;
+        return;
+    }
+    for (size_t i = lo; i <= hi && i < o->len; i++) {
+        o->flags[i] |= flag;
+    }
+}
+
+// What ARRAY_INDEX reads, if the array can only be 0 and the words the
+// offset can pick out are few and never amended: a jump table, say.
+static Val opt_load(Opt *o, const Val *arr, const Val *off)
+{
+    uint32_t a, lo, hi;
+    val_bounds(off, &lo, &hi);
+    if (!val_single(arr, &a) || a != 0 || hi - lo >= OPT_LOAD_MAX) {
+        return val_of(VAL_TOP);
+    }
+    Val r = {VAL_SET, 0, {0}};
+    for (size_t i = lo; i <= hi && i < o->len; i++) {
+        bool in = off->kind == VAL_RANGE;
+        for (int k = 0; k < off->n; k++) {
+            in |= off->v[k] == i;
+        }
+        if (!in) {
+            continue;
+        }
+        if (o->flags[i] & W_AMENDED) {
+            return val_of(VAL_TOP);
+        }
+        Val v = val_const(o->w[i]);
+        val_join(&r, &v, false);
+    }
+    // Past the end it Fails, and reads nothing.
+    return r.kind == VAL_SET && r.n == 0 ? val_of(VAL_TOP) : r;
+}
+
+// The jump at pc, through a register it can only have been given by the
+// ARRAY_INDEX just before it, goes to one of the words it can have read:
+// a jump table.
+static bool opt_table(Opt *o, size_t pc, Succ *succ)
+{
+    uint32_t w = o->w[pc], a, lo, hi;
+    if (pc == 0 || (o->flags[pc] & W_TARGET) ||
+        (o->flags[pc - 1] & (W_REACHED | W_UNKNOWN)) != W_REACHED) {
+        return false;
+    }
+    uint32_t prev = o->w[pc - 1];
+    const State *s = &o->in[pc - 1];
+    if (op_of(prev) != ARRAY_INDEX || ra(prev) != rc(w) ||
+        !val_single(&s->r[rb(prev)], &a) || a != 0) {
+        return false;
+    }
+    val_bounds(&s->r[rc(prev)], &lo, &hi);
+    if (hi - lo >= OPT_LOAD_MAX || lo >= o->len) {
+        return false;
+    }
+    hi = hi < o->len ? hi : o->len - 1;
+    for (size_t i = lo; i <= hi; i++) {
+        if (o->flags[i] & W_AMENDED) {
+            return false;
+        }
+    }
+    succ->tab = lo;
+    succ->ntab = hi - lo + 1;
+    return true;
+}
+
+// Applies the word at pc to `s`, records what it touches in array 0 if
+// o->marking, and says where control goes next.
+static void opt_step(Opt *o, size_t pc, State *s, Succ *succ)
+{
+    uint32_t w = o->w[pc];
+    *succ = (Succ){0};
+    succ->fall = pc + 1 < o->len;
+    if (o->flags[pc] & W_UNKNOWN) {
+        for (int i = 0; i < 8; i++) {
+            s->r[i] = val_of(VAL_TOP);
+        }
+        s->dirty = true;
+        s->guarded = false;
+        succ->leave = succ->any = true;
+        if (o->marking) {
+            o->read_all = o->written_all = true;
+        }
+        return;
+    }
+    uint8_t defs;
+    opt_uses(w, &defs);
+    if (op_of(w) == CMOV && !is_nop(w)) {
+        defs = 1 << ra(w);
+    }
+    if (s->guarded && (defs & (1 << s->gsel | 1 << s->gcond))) {
+        s->guarded = false;
+    }
+    Val *A = &s->r[ra(w)], *B = &s->r[rb(w)], *C = &s->r[rc(w)];
+    switch (op_of(w)) {
+        case CMOV:
+            {
+                uint32_t va, vb;
+                bool guard = ra(w) != rc(w) && val_single(A, &va) && val_single(B, &vb) &&
+                             va != vb;
+                if (!val_may_zero(C)) {
+                    *A = *B;
+                } else if (val_may_nonzero(C)) {
+                    val_join(A, B, false);
+                }
+                if (guard) {
+                    s->guarded = true;
+                    s->gsel = ra(w);
+                    s->gcond = rc(w);
+                    s->gzero = va;
+                    s->gnz = vb;
+                }
+            }
+            break;
+        case ARRAY_INDEX:
+        case ARRAY_AMEND:
+            {
+                bool amend = op_of(w) == ARRAY_AMEND;
+                const Val *arr = amend ? A : B;
+                Val *off = amend ? B : C;
+                uint32_t a;
+                if (val_may_zero(arr)) {
+                    if (o->marking) {
+                        opt_mark(o, off, amend);
+                    }
+                    s->dirty |= amend;
+                }
+                if (val_single(arr, &a) && a == 0) {
+                    // Anything past the end Fails.
+                    uint32_t lo, hi;
+                    val_bounds(off, &lo, &hi);
+                    succ->fall &= lo < o->len;
+                    val_below(off, o->len);
+                }
+                if (!amend) {
+                    *A = opt_load(o, arr, off);
+                }
+            }
+            break;
+        case ADD:
+        case MUL:
+        case DIV:
+        case NAND:
+            *A = val_binop(op_of(w), B, C);
+            break;
+        case HALT:
+            succ->fall = false;
+            break;
+        case ALLOC:
+            *B = val_of(VAL_NONZERO);
+            break;
+        case INPUT:
+            *C = val_of(VAL_TOP);
+            break;
+        case LOAD_PROG:
+            succ->fall = false;
+            if (val_may_nonzero(B)) {
+                succ->leave = true;
+            }
+            if (val_may_zero(B)) {
+                if (C->kind != VAL_SET) {
+                    succ->any = !opt_table(o, pc, succ);
+                    break;
+                }
+                for (int i = 0; i < C->n; i++) {
+                    if (C->v[i] < o->len) {
+                        succ->t[succ->n++] = C->v[i];
+                    }
+                }
+            }
+            break;
+        case ORTHOG:
+            s->r[(w >> 25) & 7] = val_const(w & 0x1ffffff);
+            break;
+        case ABANDON:
+        case OUTPUT:
+            break;
+        default:
+            succ->fall = false;
+            break;
+    }
+}
+
+// The state a jump from the word `w` arrives at `t` with: if its target
+// register came from a guarded CMOV, the target says which way the
+// condition went. False if it can't have gone that way.
+static bool opt_arrive(State *s, uint32_t w, uint32_t t)
+{
+    if (!s->guarded || rc(w) != s->gsel || rb(w) == s->gcond) {
+        return true;
+    }
+    if (t == s->gzero) {
+        return val_refine(&s->r[s->gcond], true);
+    }
+    if (t == s->gnz) {
+        return val_refine(&s->r[s->gcond], false);
+    }
+    return true;
+}
+
+// Joins y into x; returns whether x changed.
+static bool state_join(State *x, const State *y, bool widen)
+{
+    bool changed = false;
+    for (int i = 0; i < 8; i++) {
+        changed |= val_join(&x->r[i], &y->r[i], widen);
+    }
+    if (y->dirty && !x->dirty) {
+        x->dirty = changed = true;
+    }
+    if (x->guarded && (!y->guarded || x->gsel != y->gsel || x->gcond != y->gcond ||
+                       x->gzero != y->gzero || x->gnz != y->gnz)) {
+        x->guarded = false;
+        changed = true;
+    }
+    return changed;
+}
+
+static void opt_queue(Opt *o, size_t pc)
+{
+    if (!(o->flags[pc] & W_QUEUED)) {
+        o->flags[pc] |= W_QUEUED;
+        o->work[o->nwork++] = pc;
+    }
+}
+
+// Merges `s` into the state on entry to pc. A word that becomes a jump
+// target is looked at again even if its state stays the same, since
+// opt_table depends on it not being one.
+static void opt_visit(Opt *o, size_t pc, const State *s, bool target)
+{
+    bool changed = false;
+    if (target && !(o->flags[pc] & W_TARGET)) {
+        o->flags[pc] |= W_TARGET;
+        changed = true;
+    }
+    if (!(o->flags[pc] & W_REACHED)) {
+        o->flags[pc] |= W_REACHED;
+        o->in[pc] = *s;
+        changed = true;
+    } else {
+        // Every loop has a jump in it, and so a target to widen at.
+        changed = state_join(&o->in[pc], s, o->flags[pc] & W_TARGET);
+    }
+    if (changed) {
+        opt_queue(o, pc);
+    }
+}
+
+// Forward analysis to a fixed point over the current image. Every jump to
+// anywhere lands on every word with the join of their states. Words read
+// are taken to hold what they hold now unless an earlier run found them
+// amended; one that turns out to be amended, or that can run after array
+// 0 may have been amended and is itself amended (and so is unknown), sends
+// the analysis round again.
+static void opt_analyse(Opt *o)
+{
+    bool again;
+    do {
+        for (size_t pc = 0; pc < o->len; pc++) {
+            o->flags[pc] &= W_UNKNOWN | W_AMENDED;
+        }
+        o->nwork = 0;
+        o->marking = true;
+        o->read_all = o->written_all = false;
+        State entry = {0};
+        for (int i = 0; i < 8; i++) {
+            entry.r[i] = val_const(0);
+        }
+        opt_visit(o, 0, &entry, true);
+        State any;
+        bool any_seen = false, any_changed = false;
+        do {
+            if (any_changed) {
+                any_changed = false;
+                for (size_t pc = 0; pc < o->len; pc++) {
+                    opt_visit(o, pc, &any, true);
+                }
+            }
+            while (o->nwork) {
+                size_t pc = o->work[--o->nwork];
+                o->flags[pc] &= ~W_QUEUED;
+                State s = o->in[pc];
+                Succ succ;
+                opt_step(o, pc, &s, &succ);
+                if (succ.fall) {
+                    opt_visit(o, pc + 1, &s, false);
+                    if (op_of(o->w[pc]) == ARRAY_INDEX) {
+                        opt_queue(o, pc + 1);   // for opt_table
+                    }
+                }
+                for (int i = 0; i < succ.n; i++) {
+                    State t = s;
+                    if (opt_arrive(&t, o->w[pc], succ.t[i])) {
+                        opt_visit(o, succ.t[i], &t, true);
+                    }
+                }
+                for (uint32_t i = 0; i < succ.ntab; i++) {
+                    uint32_t t = o->w[succ.tab + i];
+                    if (t < o->len) {
+                        opt_visit(o, t, &s, true);
+                    }
+                }
+                if (succ.any && !any_seen) {
+                    any = s;
+                    any_seen = any_changed = true;
+                } else if (succ.any) {
+                    any_changed |= state_join(&any, &s, true);
+                }
+            }
+        } while (any_changed);
+        o->marking = false;
+
+        again = false;
+        for (size_t pc = 0; pc < o->len; pc++) {
+            o->flags[pc] |= (o->read_all ? W_READ : 0) | (o->written_all ? W_WRITTEN : 0);
+            if ((o->flags[pc] & (W_WRITTEN | W_AMENDED)) == W_WRITTEN) {
+                o->flags[pc] |= W_AMENDED;
+                again = true;
+            }
+            if ((o->flags[pc] & (W_REACHED | W_WRITTEN | W_UNKNOWN)) == (W_REACHED | W_WRITTEN) &&
+                o->in[pc].dirty) {
+                o->flags[pc] |= W_UNKNOWN;
+                again = true;
+            }
+        }
+    } while (again);
+}
+
+static void opt_successors(Opt *o, size_t pc, Succ *succ)
+{
+    State s = o->in[pc];
+    opt_step(o, pc, &s, succ);
+}
+
+static uint8_t opt_live_out(Opt *o, size_t pc)
+{
+    Succ succ;
+    opt_successors(o, pc, &succ);
+    uint8_t out = succ.leave || succ.any ? 0xff : 0;
+    if (succ.fall) {
+        out |= o->live[pc + 1];
+    }
+    for (int i = 0; i < succ.n; i++) {
+        out |= o->live[succ.t[i]];
+    }
+    for (uint32_t i = 0; i < succ.ntab; i++) {
+        uint32_t t = o->w[succ.tab + i];
+        out |= t < o->len ? o->live[t] : 0;
+    }
+    return out;
+}
+
+// Backward liveness over the reached words, swept to a fixed point.
+static void opt_liveness(Opt *o)
+{
+    memset(o->live, 0, o->len);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t pc = o->len; pc-- > 0;) {
+            if (!(o->flags[pc] & W_REACHED)) {
+                continue;
+            }
+            uint8_t defs;
+            uint8_t uses = opt_uses(o->w[pc], &defs);
+            uint8_t in = (opt_live_out(o, pc) & ~defs) | uses;
+            if (in != o->live[pc]) {
+                o->live[pc] = in;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool opt_rewritable(Opt *o, size_t pc)
+{
+    return (o->flags[pc] & (W_REACHED | W_READ | W_WRITTEN | W_UNKNOWN)) == W_REACHED;
+}
+
+static size_t opt_fold(Opt *o)
+{
+    size_t n = 0;
+    for (size_t pc = 0; pc < o->len; pc++) {
+        uint32_t w = o->w[pc], v;
+        if (!opt_rewritable(o, pc) || op_of(w) == ORTHOG || !opt_result(o, pc, &v) ||
+            v > 0x1ffffff) {
+            continue;
+        }
+        // A DIV folds only if it can't Fail, which opt_result has checked.
+        o->w[pc] = orthog(ra(w), v);
+        n++;
+    }
+    return n;
+}
+
+static size_t opt_dead_writes(Opt *o)
+{
+    size_t total = 0, n;
+    do {
+        opt_liveness(o);
+        n = 0;
+        for (size_t pc = 0; pc < o->len; pc++) {
+            uint32_t w = o->w[pc];
+            if (!opt_rewritable(o, pc) || is_nop(w)) {
+                continue;
+            }
+            uint8_t defs;
+            opt_uses(w, &defs);
+            switch (op_of(w)) {
+                case DIV:
+                    if (val_may_zero(&o->in[pc].r[rc(w)])) {
+                        continue;
+                    }
+                    break;
+                case CMOV:
+                    defs = 1 << ra(w);
+                    break;
+                case ADD:
+                case MUL:
+                case NAND:
+                case ORTHOG:
+                    break;
+                default:
+                    continue;
+            }
+            if (!(opt_live_out(o, pc) & defs)) {
+                o->w[pc] = OPT_NOP;
+                n++;
+            }
+        }
+        total += n;
+    } while (n);
+    return total;
+}
+
+// The ORTHOG that sets the target register of the jump at `pc` within its
+// block, if nothing else reads that register before the jump.
+static bool opt_jump_source(Opt *o, size_t pc, size_t *src)
+{
+    uint32_t reg = rc(o->w[pc]);
+    for (size_t p = pc; p-- > 0;) {
+        uint32_t w = o->w[p];
+        uint8_t defs;
+        uint8_t uses = opt_uses(w, &defs);
+        if (o->flags[p + 1] & W_TARGET) {
+            return false;
+        }
+        if (defs & (1 << reg)) {
+            if (op_of(w) != ORTHOG || !opt_rewritable(o, p)) {
+                return false;
+            }
+            *src = p;
+            return true;
+        }
+        if ((uses & (1 << reg)) || !(o->flags[p] & W_REACHED)) {
+            return false;
+        }
+        Succ succ;
+        opt_successors(o, p, &succ);
+        if (!succ.fall || succ.n || succ.any || succ.ntab) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Where a jump to `t` really ends up, if `t` opens a block of no-ops
+// followed by ORTHOG rX and a jump through rX, and skipping it leaves
+// every register that matters unchanged.
+static bool opt_chain_end(Opt *o, size_t t, uint32_t jump_reg, uint32_t *end)
+{
+    size_t p = t;
+    while (p < o->len && is_nop(o->w[p]) && (o->flags[p] & W_REACHED)) {
+        p++;
+    }
+    if (p + 1 >= o->len || op_of(o->w[p]) != ORTHOG || op_of(o->w[p + 1]) != LOAD_PROG ||
+        (o->flags[p + 1] & W_TARGET)) {
+        return false;
+    }
+    uint32_t x = (o->w[p] >> 25) & 7;
+    uint32_t load = o->w[p + 1];
+    uint32_t z;
+    if (rc(load) != x || rb(load) == x || !val_single(&o->in[p + 1].r[rb(load)], &z) ||
+        z != 0) {
+        return false;
+    }
+    uint32_t t2 = o->w[p] & 0x1ffffff;
+    if (t2 >= o->len || t2 == t) {
+        return false;
+    }
+    // The chain leaves rX = t2 and the jump register = t, where the direct
+    // jump leaves its register = t2 and rX as it was.
+    if (x != jump_reg && (o->live[t2] & (1 << x | 1 << jump_reg))) {
+        return false;
+    }
+    *end = t2;
+    return true;
+}
+
+static size_t opt_thread(Opt *o)
+{
+    size_t n = 0;
+    for (size_t pc = 0; pc < o->len; pc++) {
+        uint32_t w = o->w[pc], t, t2, z;
+        size_t src;
+        if (!(o->flags[pc] & W_REACHED) || op_of(w) != LOAD_PROG ||
+            !val_single(&o->in[pc].r[rb(w)], &z) || z != 0 ||
+            !val_single(&o->in[pc].r[rc(w)], &t) || t >= o->len ||
+            !opt_chain_end(o, t, rc(w), &t2) || !opt_jump_source(o, pc, &src)) {
+            continue;
+        }
+        o->w[src] = orthog(rc(w), t2);
+        n++;
+    }
+    return n;
+}
+
+// Replaces long runs of no-ops with a jump past them, through two
+// registers that are dead where the run ends.
+static size_t opt_skip_nops(Opt *o)
+{
+    size_t n = 0;
+    for (size_t pc = 0; pc < o->len; pc++) {
+        if (!is_nop(o->w[pc]) || !opt_rewritable(o, pc)) {
+            continue;
+        }
+        size_t end = pc;
+        while (end < o->len && is_nop(o->w[end]) && (o->flags[end] & W_REACHED)) {
+            end++;
+        }
+        size_t run = end - pc;
+        if (run < OPT_SKIP_MIN || end >= o->len || end > 0x1ffffff ||
+            !opt_rewritable(o, pc + 1) || !opt_rewritable(o, pc + 2) ||
+            (o->flags[pc + 1] & W_TARGET) || (o->flags[pc + 2] & W_TARGET)) {
+            pc = end;
+            continue;
+        }
+        int regs[2], found = 0;
+        for (int r = 0; r < 8 && found < 2; r++) {
+            if (!(o->live[end] & (1 << r))) {
+                regs[found++] = r;
+            }
+        }
+        if (found == 2) {
+            o->w[pc] = orthog(regs[0], 0);
+            o->w[pc + 1] = orthog(regs[1], end);
+            o->w[pc + 2] = instr(LOAD_PROG, 0, regs[0], regs[1]);
+            n++;
+        }
+        pc = end;
+    }
+    return n;
+}
+
+// Whether some word that can run reads or amends array 0 past its end.
+// The analysis takes that to Fail, but an image that does it on purpose
+// is more likely a prefix that something is appended to before it runs
+// (as um.um has its guest appended), which the analysis can't see.
+static bool opt_past_end(Opt *o)
+{
+    for (size_t pc = 0; pc < o->len; pc++) {
+        uint32_t w = o->w[pc], a, lo, hi;
+        if ((o->flags[pc] & (W_REACHED | W_UNKNOWN)) != W_REACHED ||
+            (op_of(w) != ARRAY_INDEX && op_of(w) != ARRAY_AMEND)) {
+            continue;
+        }
+        const State *s = &o->in[pc];
+        bool amend = op_of(w) == ARRAY_AMEND;
+        if (val_single(&s->r[amend ? ra(w) : rb(w)], &a) && a == 0) {
+            val_bounds(&s->r[amend ? rb(w) : rc(w)], &lo, &hi);
+            if (lo >= o->len) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static size_t opt_unreachable(Opt *o)
+{
+    size_t n = 0;
+    for (size_t pc = 0; pc < o->len; pc++) {
+        if (!(o->flags[pc] & (W_REACHED | W_READ | W_WRITTEN)) && o->w[pc] != 0) {
+            o->w[pc] = 0;
+            n++;
+        }
+    }
+    return n;
+}
+
+static bool read_image(const char *path, uint32_t **words, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    fseek(f, 0L, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    uint8_t *bytes = malloc(size + 1);
+    if (!bytes || fread(bytes, 1, size, f) != (size_t)size) {
+        fclose(f);
+        free(bytes);
+        return false;
+    }
+    fclose(f);
+    *len = size / 4;
+    *words = malloc(sizeof(uint32_t) * (*len + 1));
+    if (!*words) {
+        free(bytes);
+        return false;
+    }
+    for (size_t i = 0; i < *len; i++) {
+        const uint8_t *p = bytes + i * 4;
+        (*words)[i] = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    }
+    free(bytes);
+    return true;
+}
+
+static bool write_image(const char *path, const uint32_t *words, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        uint8_t b[4] = {words[i] >> 24, words[i] >> 16, words[i] >> 8, words[i]};
+        if (fwrite(b, 1, 4, f) != 4) {
+            fclose(f);
+            return false;
+        }
+    }
+    return fclose(f) == 0;
+}
+
+static size_t opt_count(Opt *o, uint8_t flag)
+{
+    size_t n = 0;
+    for (size_t pc = 0; pc < o->len; pc++) {
+        n += (o->flags[pc] & flag) != 0;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s input output\n", argv[0]);
+        return 1;
+    }
+    Opt o = {0};
+    if (!read_image(argv[1], &o.w, &o.len)) {
+        perror("reading program");
+        return 1;
+    }
+    size_t orig_len = o.len;
+    if (o.len == 0) {
+        o.bail = "the program is empty";
+    } else {
+        o.in = malloc(sizeof(State) * o.len);
+        o.flags = calloc(o.len, 1);
+        o.live = malloc(o.len);
+        o.work = malloc(sizeof(size_t) * (o.len + 1));
+        if (!o.in || !o.flags || !o.live || !o.work) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+
+    size_t folded = 0, dead = 0, threaded = 0, skipped = 0, zeroed = 0;
+    if (!o.bail) {
+        opt_analyse(&o);
+        fprintf(stderr, "%zu words, %zu reachable, %zu read as data, %zu amended, "
+                "%zu amended before they run\n",
+                o.len, opt_count(&o, W_REACHED), opt_count(&o, W_READ),
+                opt_count(&o, W_WRITTEN), opt_count(&o, W_UNKNOWN));
+        if (opt_past_end(&o)) {
+            o.bail = "array 0 is used past its end, as if more is appended to it";
+        }
+    }
+    if (!o.bail) {
+        folded = opt_fold(&o);
+        opt_analyse(&o);
+        dead = opt_dead_writes(&o);
+        for (int round = 0; round < OPT_THREAD_ROUNDS; round++) {
+            opt_analyse(&o);
+            opt_liveness(&o);
+            size_t n = opt_thread(&o);
+            if (!n) {
+                break;
+            }
+            threaded += n;
+        }
+        opt_analyse(&o);
+        dead += opt_dead_writes(&o);
+        opt_analyse(&o);
+        opt_liveness(&o);
+        skipped = opt_skip_nops(&o);
+        opt_analyse(&o);
+        zeroed = opt_unreachable(&o);
+        while (o.len > 1 && o.w[o.len - 1] == 0 &&
+               !(o.flags[o.len - 1] & (W_REACHED | W_READ | W_WRITTEN))) {
+            o.len--;
+        }
+    }
+    if (o.bail) {
+        fprintf(stderr, "left unchanged: %s\n", o.bail);
+    } else {
+        fprintf(stderr, "folded %zu, dropped %zu dead writes, threaded %zu jumps, "
+                "skipped %zu no-op runs, zeroed %zu unreachable words, trimmed %zu\n",
+                folded, dead, threaded, skipped, zeroed, orig_len - o.len);
+    }
+    if (!write_image(argv[2], o.w, o.len)) {
+        perror("writing program");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+
+// Pipelines: each stage is a machine on its own thread, and the OUTPUT of
+// one is the INPUT of the next through a single-producer single-consumer
+// ring. Both ends hand out spans of the ring itself, so a byte is written
+// by one machine's OUTPUT and read by the next one's INPUT where it lies.
+// A stage that halts (or Fails) closes its end, which the next stage sees
+// as end of input once the ring drains.
+
+#define RING_SIZE (256 * 1024)
+// Output is published a span at a time, so a stage that writes steadily
+// is never more than this far ahead of what the next one can see.
+#define RING_SPAN (16 * 1024)
+
+typedef struct Ring {
+    uint8_t buf[RING_SIZE];
+    _Atomic size_t head;        // total bytes written
+    _Atomic size_t tail;        // total bytes read
+    atomic_bool writer_done;
+    atomic_bool reader_done;
+    atomic_int sleepers;        // ends waiting on `cond`
+    atomic_int refs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Ring;
+
+typedef struct StageIo {
+    Ring *in;               // input ring, or NULL to read through `fd`
+    Ring *out;              // output ring, or NULL to write through `fd`
+    IoBackend fd;
+    bool discarding;        // the reader is gone; output goes to `scratch`
+    uint8_t scratch[4096];
+} StageIo;
+
+typedef struct Stage {
+    int index;
+    Machine vm;
+    pthread_t thread;
+    RunStatus status;
+} Stage;
+
+static Ring *ring_new(void)
+{
+    Ring *r = xcalloc(1, sizeof(Ring));
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    atomic_store(&r->refs, 2);
+    return r;
+}
+
+static void ring_unref(Ring *r)
+{
+    if (atomic_fetch_sub(&r->refs, 1) == 1) {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        free(r);
+    }
+}
+
+// Wakes the other end if it is asleep. The sleeper registers before it
+// re-checks the ring, so with sequentially consistent atomics one side or
+// the other always sees the change.
+static void ring_wake(Ring *r)
+{
+    if (atomic_load(&r->sleepers)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+// Sleeps until `ready` holds.
+static void ring_wait(Ring *r, bool (*ready)(Ring *))
+{
+    if (ready(r)) {
+        return;
+    }
+    pthread_mutex_lock(&r->lock);
+    atomic_fetch_add(&r->sleepers, 1);
+    while (!ready(r)) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    atomic_fetch_sub(&r->sleepers, 1);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static bool ring_writable(Ring *r)
+{
+    return atomic_load(&r->head) - atomic_load(&r->tail) < RING_SIZE ||
+           atomic_load(&r->reader_done);
+}
+
+static bool ring_readable(Ring *r)
+{
+    return atomic_load(&r->head) != atomic_load(&r->tail) ||
+           atomic_load(&r->writer_done);
+}
+
+static uint8_t *stage_out_span(void *ctx, size_t *cap)
+{
+    StageIo *io = ctx;
+    Ring *r = io->out;
+    if (!r) {
+        return io->fd.out_span(io->fd.ctx, cap);
+    }
+    ring_wait(r, ring_writable);
+    size_t head = atomic_load(&r->head);
+    size_t room = RING_SIZE - (head - atomic_load(&r->tail));
+    io->discarding = atomic_load(&r->reader_done);
+    if (io->discarding) {
+        *cap = sizeof(io->scratch);
+        return io->scratch;
+    }
+    size_t off = head % RING_SIZE;
+    size_t n = RING_SIZE - off;
+    n = n < room ? n : room;
+    *cap = n < RING_SPAN ? n : RING_SPAN;
+    return r->buf + off;
+}
+
+static void stage_out_commit(void *ctx, size_t n)
+{
+    StageIo *io = ctx;
+    Ring *r = io->out;
+    if (!r) {
+        io->fd.out_commit(io->fd.ctx, n);
+        return;
+    }
+    if (!io->discarding) {
+        atomic_fetch_add(&r->head, n);
+        ring_wake(r);
+    }
+}
+
+static int stage_in_span(void *ctx, const uint8_t **data, size_t *len)
+{
+    StageIo *io = ctx;
+    Ring *r = io->in;
+    if (!r) {
+        return io->fd.in_span(io->fd.ctx, data, len);
+    }
+    ring_wait(r, ring_readable);
+    size_t tail = atomic_load(&r->tail);
+    size_t avail = atomic_load(&r->head) - tail;
+    if (avail == 0) {
+        return IO_EOF;
+    }
+    size_t off = tail % RING_SIZE;
+    size_t n = RING_SIZE - off;
+    *data = r->buf + off;
+    *len = n < avail ? n : avail;
+    return IO_OK;
+}
+
+static void stage_in_consume(void *ctx, size_t n)
+{
+    StageIo *io = ctx;
+    Ring *r = io->in;
+    if (!r) {
+        io->fd.in_consume(io->fd.ctx, n);
+        return;
+    }
+    if (n) {
+        atomic_fetch_add(&r->tail, n);
+        ring_wake(r);
+    }
+}
+
+static void stage_destroy(void *ctx)
+{
+    StageIo *io = ctx;
+    if (io->in) {
+        atomic_store(&io->in->reader_done, true);
+        ring_wake(io->in);
+        ring_unref(io->in);
+    }
+    if (io->out) {
+        atomic_store(&io->out->writer_done, true);
+        ring_wake(io->out);
+        ring_unref(io->out);
+    }
+    um_32_io_close(&io->fd);
+    free(io);
+}
+
+// A backend reading from `in` and writing to `out`; whichever is NULL is
+// replaced by the process's stdin or stdout.
+static void um_32_io_stage(IoBackend *io, Ring *in, Ring *out)
+{
+    StageIo *sio = xcalloc(1, sizeof(StageIo));
+    sio->in = in;
+    sio->out = out;
+    if (!in || !out) {
+        um_32_io_fd(&sio->fd, STDIN_FILENO, STDOUT_FILENO);
+    }
+    *io = (IoBackend){0};
+    io->ctx = sio;
+    io->out_span = stage_out_span;
+    io->out_commit = stage_out_commit;
+    io->in_span = stage_in_span;
+    io->in_consume = stage_in_consume;
+    io->destroy = stage_destroy;
+    io->line_flush = out ? false : sio->fd.line_flush;
+}
+
+static void *stage_main(void *arg)
+{
+    Stage *st = arg;
+    st->status = um_32_run(&st->vm, UINT64_MAX);
+    if (st->status == RUN_FAILED) {
+        fprintf(stderr, "** stage %d failed\n", st->index + 1);
+        um_32_print_fault(&st->vm);
+    }
+    // Closing the backend closes this stage's ends of its rings, which
+    // is what lets its neighbours finish.
+    um_32_io_close(&st->vm.io);
+    return NULL;
+}
+
+int um_32_pipeline(Buffer *progs, int n)
+{
+    um_32_descriptor.many = 1;
+    Stage *stages = xcalloc(n, sizeof(Stage));
+    Ring *prev = NULL;
+    for (int i = 0; i < n; i++) {
+        Ring *next = i + 1 < n ? ring_new() : NULL;
+        stages[i].index = i;
+        um_32_init(&stages[i].vm, progs[i]);
+        um_32_io_stage(&stages[i].vm.io, prev, next);
+        prev = next;
+    }
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&stages[i].thread, NULL, stage_main, &stages[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    int status = 0;
+    for (int i = 0; i < n; i++) {
+        pthread_join(stages[i].thread, NULL);
+        if (stages[i].status == RUN_FAILED) {
+            status = 1;
+        }
+        um_32_shutdown(&stages[i].vm);
+    }
+    free(stages);
+    return status;
+}
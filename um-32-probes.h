@@ -0,0 +1,79 @@
+#ifndef UM_32_PROBES_H
+#define UM_32_PROBES_H
+
+// Static tracepoints, in the format of SystemTap's <sys/sdt.h> so that
+// bpftrace, perf and gdb find them (as usdt:um-32:um32:NAME) without the
+// header having to be installed. Each is a nop in the code plus an ELF
+// note naming the probe and saying where its arguments are; a tracer that
+// attaches turns the nop into a breakpoint. Every argument is passed as
+// a 64-bit unsigned integer.
+//
+//     bpftrace -e 'usdt:./um-32:um32:alloc { @len = hist(arg1); }'
+//
+// The probes, with their arguments:
+//
+//     alloc           id, length in platters
+//     abandon         id, length in platters
+//     load_prog       id, finger before, finger after
+//     input_block     -
+//     input_unblock   IO_* status, bytes available
+//     output_flush    bytes
+//     halt            finger, instructions retired
+//     exception       finger, instruction
+//
+// Fingers are those of um_32_run; LOAD_PROG in the um.um fast path gives
+// them as the inner program sees them. The lockstep engine fires halt and
+// load_prog once per lane, and sibling machines fire alloc and abandon
+// like any other. Build with -DUM_32_NO_PROBES to leave the notes out.
+
+#include <stdint.h>
+
+#if !defined(UM_32_NO_PROBES) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#define UM_32_PROBE_NOTE(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"um32\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define UM_32_PROBE(name) \
+    __asm__ __volatile__(UM_32_PROBE_NOTE(name, "") : :)
+#define UM_32_PROBE1(name, a) \
+    __asm__ __volatile__(UM_32_PROBE_NOTE(name, "8@%[a1]") \
+            : : [a1] "nor" ((uint64_t)(a)))
+#define UM_32_PROBE2(name, a, b) \
+    __asm__ __volatile__(UM_32_PROBE_NOTE(name, "8@%[a1] 8@%[a2]") \
+            : : [a1] "nor" ((uint64_t)(a)), [a2] "nor" ((uint64_t)(b)))
+#define UM_32_PROBE3(name, a, b, c) \
+    __asm__ __volatile__(UM_32_PROBE_NOTE(name, "8@%[a1] 8@%[a2] 8@%[a3]") \
+            : : [a1] "nor" ((uint64_t)(a)), [a2] "nor" ((uint64_t)(b)), \
+                [a3] "nor" ((uint64_t)(c)))
+
+#else
+
+#define UM_32_PROBE(name) ((void)0)
+#define UM_32_PROBE1(name, a) ((void)0)
+#define UM_32_PROBE2(name, a, b) ((void)0)
+#define UM_32_PROBE3(name, a, b, c) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+// Sampling profiler for a running um-32, from outside the process. It
+// finds um_32_descriptor in the executable's symbol table, adds where the
+// executable is mapped, and from then on only reads the target's memory
+// with process_vm_readv: the finger, the registers and the word under the
+// finger, at a fixed rate, while the target runs on undisturbed. A
+// process nobody is watching pays nothing.
+//
+// The target is not stopped, so a sample can be torn (a finger from one
+// instruction, a word from the next); at the rates a profile needs that
+// is noise. While the target runs um.um's fast path its finger sits at
+// the dispatch loop, and it is counted there. A multi-session host is
+// sampled across whichever session is running its quantum; modes that
+// run several machines at once on separate threads can't be sampled.
+//
+// Needs the same permission as ptrace: the same user, or CAP_SYS_PTRACE
+// where Yama says so.
+
+#define SAMPLE_MIN_CAP 1024
+
+static const char *sample_op_names[] = {
+    "cmov", "arrind", "arramend", "add", "mul", "div", "nand", "halt",
+    "alloc", "abandon", "output", "input", "loadprog", "orthog", "ext", "?",
+};
+
+typedef struct Hot {
+    uint32_t pc;
+    uint32_t inst;          // the word there when last sampled
+    uint32_t r[8];          // and the registers
+    uint64_t count;
+} Hot;
+
+typedef struct Sampler {
+    pid_t pid;
+    uintptr_t desc_addr;
+    MachineDescriptor desc;
+    Hot *hot;               // open-addressed on pc, count 0 for empty
+    size_t cap;             // a power of two
+    size_t n;
+    uint64_t samples;
+    uint64_t idle;          // no machine running
+    uint64_t missed;        // a read failed, e.g. mid-reallocation
+    size_t len_min;         // array 0, in platters
+    size_t len_max;
+} Sampler;
+
+static volatile sig_atomic_t stop;
+
+static void sample_stop(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static bool sample_read(Sampler *s, uintptr_t addr, void *buf, size_t n)
+{
+    struct iovec local = {buf, n};
+    struct iovec remote = {(void *)addr, n};
+    return process_vm_readv(s->pid, &local, 1, &remote, 1, 0) == (ssize_t)n;
+}
+
+// The address of `name` in the executable's symbol table, before
+// relocation; 0 if it has none.
+static uintptr_t find_symbol(const char *path, const char *name, bool *pie)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Elf64_Ehdr)) {
+        close(fd);
+        return 0;
+    }
+    uint8_t *img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img == MAP_FAILED) {
+        return 0;
+    }
+    uintptr_t addr = 0;
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)img;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh->e_shoff + (size_t)eh->e_shnum * sizeof(Elf64_Shdr) > (size_t)st.st_size) {
+        goto out;
+    }
+    *pie = eh->e_type == ET_DYN;
+    const Elf64_Shdr *sh = (const Elf64_Shdr *)(img + eh->e_shoff);
+    for (int i = 0; i < eh->e_shnum && !addr; i++) {
+        if (sh[i].sh_type != SHT_SYMTAB && sh[i].sh_type != SHT_DYNSYM) {
+            continue;
+        }
+        const Elf64_Shdr *strs = &sh[sh[i].sh_link];
+        const Elf64_Sym *syms = (const Elf64_Sym *)(img + sh[i].sh_offset);
+        size_t nsyms = sh[i].sh_size / sizeof(Elf64_Sym);
+        for (size_t k = 0; k < nsyms; k++) {
+            if (syms[k].st_name < strs->sh_size &&
+                strcmp((const char *)img + strs->sh_offset + syms[k].st_name, name) == 0) {
+                addr = syms[k].st_value;
+                break;
+            }
+        }
+    }
+out:
+    munmap(img, st.st_size);
+    return addr;
+}
+
+// Where the executable's first page is mapped in the target.
+static uintptr_t find_base(pid_t pid)
+{
+    char path[64], exe[4096];
+    snprintf(path, sizeof(path), "/proc/%d/exe", (int)pid);
+    ssize_t n = readlink(path, exe, sizeof(exe) - 1);
+    if (n < 0) {
+        return 0;
+    }
+    exe[n] = 0;
+    snprintf(path, sizeof(path), "/proc/%d/maps", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    char line[4096 + 128];
+    uintptr_t base = 0;
+    while (!base && fgets(line, sizeof(line), f)) {
+        unsigned long lo, off;
+        int pathpos = 0;
+        if (sscanf(line, "%lx-%*x %*s %lx %*s %*s %n", &lo, &off, &pathpos) == 2 && pathpos &&
+            off == 0 && strncmp(line + pathpos, exe, n) == 0 && line[pathpos + n] == '\n') {
+            base = lo;
+        }
+    }
+    fclose(f);
+    return base;
+}
+
+static bool sample_attach(Sampler *s)
+{
+    char exe[64];
+    snprintf(exe, sizeof(exe), "/proc/%d/exe", (int)s->pid);
+    bool pie = false;
+    uintptr_t addr = find_symbol(exe, "um_32_descriptor", &pie);
+    if (!addr) {
+        fprintf(stderr, "no um_32_descriptor in %s (not um-32, or stripped)\n", exe);
+        return false;
+    }
+    if (pie) {
+        uintptr_t base = find_base(s->pid);
+        if (!base) {
+            fprintf(stderr, "cannot find where %s is mapped\n", exe);
+            return false;
+        }
+        addr += base;
+    }
+    s->desc_addr = addr;
+    if (!sample_read(s, addr, &s->desc, sizeof(s->desc))) {
+        perror("reading the descriptor");
+        return false;
+    }
+    if (s->desc.magic != UM_32_DESCRIPTOR_MAGIC || s->desc.version != UM_32_DESCRIPTOR_VERSION) {
+        fprintf(stderr, "descriptor version %u, expected %u\n",
+                s->desc.version, UM_32_DESCRIPTOR_VERSION);
+        return false;
+    }
+    if (s->desc.many) {
+        fprintf(stderr, "%d runs several machines at once (-p, -L or -b), "
+                "and can't be sampled\n", s->pid);
+        return false;
+    }
+    return true;
+}
+
+static inline size_t hot_hash(uint32_t pc)
+{
+    return pc * 0x9e3779b97f4a7c15ull >> 32;
+}
+
+static Hot *hot_slot(Hot *hot, size_t cap, uint32_t pc)
+{
+    size_t i = hot_hash(pc) & (cap - 1);
+    while (hot[i].count && hot[i].pc != pc) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &hot[i];
+}
+
+static void hot_add(Sampler *s, uint32_t pc, uint32_t inst, const uint32_t *r)
+{
+    Hot *h = hot_slot(s->hot, s->cap, pc);
+    if (!h->count) {
+        if ((s->n + 1) * 2 > s->cap) {
+            size_t cap = s->cap * 2;
+            Hot *hot = calloc(cap, sizeof(Hot));
+            if (!hot) {
+                perror("growing the profile");
+                exit(1);
+            }
+            for (size_t i = 0; i < s->cap; i++) {
+                if (s->hot[i].count) {
+                    *hot_slot(hot, cap, s->hot[i].pc) = s->hot[i];
+                }
+            }
+            free(s->hot);
+            s->hot = hot;
+            s->cap = cap;
+            h = hot_slot(s->hot, s->cap, pc);
+        }
+        h->pc = pc;
+        s->n++;
+    }
+    h->inst = inst;
+    memcpy(h->r, r, sizeof(h->r));
+    h->count++;
+}
+
+static void sample_once(Sampler *s)
+{
+    MachineDescriptor *d = &s->desc;
+    uintptr_t vm;
+    if (!sample_read(s, s->desc_addr + offsetof(MachineDescriptor, vm), &vm, sizeof(vm))) {
+        s->missed++;
+        return;
+    }
+    if (!vm) {
+        s->idle++;
+        return;
+    }
+    uint32_t pc, r[8];
+    uintptr_t table;
+    uint8_t mem[64];
+    uintptr_t inst;
+    size_t len;
+    uint32_t word;
+    if (d->mem_size > sizeof(mem) ||
+        !sample_read(s, vm + d->pc_offset, &pc, sizeof(pc)) ||
+        !sample_read(s, vm + d->r_offset, r, sizeof(r)) ||
+        !sample_read(s, vm + d->m_offset, &table, sizeof(table)) ||
+        !sample_read(s, table, mem, d->mem_size)) {
+        s->missed++;
+        return;
+    }
+    memcpy(&inst, mem + d->inst_offset, sizeof(inst));
+    memcpy(&len, mem + d->len_offset, sizeof(len));
+    // The finger has already moved past the instruction being run.
+    uint32_t at = pc ? pc - 1 : 0;
+    if (at >= len || !sample_read(s, inst + (uintptr_t)at * 4, &word, sizeof(word))) {
+        s->missed++;
+        return;
+    }
+    s->samples++;
+    if (s->samples == 1 || len < s->len_min) {
+        s->len_min = len;
+    }
+    if (len > s->len_max) {
+        s->len_max = len;
+    }
+    hot_add(s, at, word, r);
+}
+
+static void disassemble(uint32_t inst, char *buf, size_t n)
+{
+    uint32_t op = inst >> 28;
+    if (op == ORTHOG) {
+        snprintf(buf, n, "%-8s r%u <- 0x%x", sample_op_names[op], (inst >> 25) & 7,
+                 inst & 0x1ffffff);
+    } else {
+        snprintf(buf, n, "%-8s r%u r%u r%u", sample_op_names[op],
+                 (inst >> 6) & 7, (inst >> 3) & 7, inst & 7);
+    }
+}
+
+static int hot_by_count(const void *a, const void *b)
+{
+    const Hot *x = a, *y = b;
+    return x->count > y->count ? -1 : x->count < y->count;
+}
+
+static void sample_report(Sampler *s, size_t top)
+{
+    Hot *hot = malloc(sizeof(Hot) * (s->n + 1));
+    if (!hot) {
+        perror("sorting the profile");
+        exit(1);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < s->cap; i++) {
+        if (s->hot[i].count) {
+            hot[n++] = s->hot[i];
+        }
+    }
+    qsort(hot, n, sizeof(Hot), hot_by_count);
+    uint32_t many = 0;
+    if (sample_read(s, s->desc_addr + offsetof(MachineDescriptor, many), &many, sizeof(many)) &&
+        many) {
+        printf("the target went on to run several machines at once, which can't be sampled\n");
+    }
+    printf("%llu samples over %zu fingers, %llu with no machine running, %llu missed\n",
+           (unsigned long long)s->samples, n, (unsigned long long)s->idle,
+           (unsigned long long)s->missed);
+    if (s->samples) {
+        printf("array 0: %zu to %zu platters\n", s->len_min, s->len_max);
+    }
+    printf("\n%10s %8s %6s  %-24s %s\n", "finger", "samples", "%", "instruction",
+           "registers when last sampled");
+    for (size_t i = 0; i < n && i < top; i++) {
+        char dis[64];
+        disassemble(hot[i].inst, dis, sizeof(dis));
+        printf("%10u %8llu %5.1f%%  %-24s", hot[i].pc, (unsigned long long)hot[i].count,
+               100.0 * hot[i].count / s->samples, dis);
+        for (int k = 0; k < 8; k++) {
+            printf(" %x", hot[i].r[k]);
+        }
+        printf("\n");
+    }
+    free(hot);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: %s [-f hz] [-d secs] [-n top] pid\n", program_invocation_name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -f HZ    samples per second (default 997)\n");
+    fprintf(stderr, "  -d SECS  stop after SECS seconds (default: at SIGINT or exit)\n");
+    fprintf(stderr, "  -n TOP   fingers to report (default 30)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned hz = 997;
+    double secs = 0;
+    size_t top = 30;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:d:n:")) != -1) {
+        switch (opt) {
+            case 'f':
+                hz = atoi(optarg);
+                if (hz < 1 || hz > 1000000) {
+                    usage();
+                }
+                break;
+            case 'd':
+                secs = atof(optarg);
+                if (secs <= 0) {
+                    usage();
+                }
+                break;
+            case 'n':
+                top = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind != 1) {
+        usage();
+    }
+    Sampler s = {0};
+    s.pid = atoi(argv[optind]);
+    if (s.pid <= 0 || !sample_attach(&s)) {
+        return 1;
+    }
+    s.cap = SAMPLE_MIN_CAP;
+    s.hot = calloc(s.cap, sizeof(Hot));
+    if (!s.hot) {
+        perror("allocating the profile");
+        return 1;
+    }
+
+    struct sigaction sa = {0};
+    sa.sa_handler = sample_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    struct timespec now, next;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    next = now;
+    double end = now.tv_sec + now.tv_nsec / 1e9 + secs;
+    long period = 1000000000L / hz;
+    while (!stop) {
+        if (kill(s.pid, 0) < 0) {
+            break;
+        }
+        sample_once(&s);
+        next.tv_nsec += period;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        if (secs && next.tv_sec + next.tv_nsec / 1e9 >= end) {
+            break;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    sample_report(&s, top);
+    free(s.hot);
+    return 0;
+}
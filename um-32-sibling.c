@@ -0,0 +1,509 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+#include "um-32-probes.h"
+
+// Sibling machines (-x): EXT_SPAWN starts a new machine on its own thread
+// that shares everything with its spawner but the registers and the
+// finger, and EXT_JOIN waits for one to halt. The machine that spawned
+// first (the root) and all its siblings share array 0, the array table,
+// the region arrays are carved from, and the console.
+//
+// Memory ordering, as guests may rely on it:
+//
+//   - EXT_SPAWN is a barrier: the new sibling sees everything its spawner
+//     did before it.
+//   - EXT_JOIN is a barrier: the joiner sees everything the joined
+//     sibling did.
+//   - ALLOC and ABANDON are serialized, and each is a barrier with every
+//     other ALLOC and ABANDON. An identifier another sibling has just
+//     allocated can be used as soon as it is known.
+//   - ARRAY_AMEND is relaxed: a platter is never seen torn, but amends
+//     by one sibling may be seen by another late, in any order, or not
+//     at all until a barrier. That includes amends to array 0; a sibling
+//     may go on running code another one has since overwritten.
+//   - Using an array after another sibling abandoned it without a
+//     barrier in between is a guest bug, though not a host one: an
+//     abandoned array, like an outgrown table, is kept until every
+//     machine has been quiet since (see below).
+//
+// While there are siblings, loading any array but 0 as the program makes
+// the loading machine Fail. Input is handed out a byte at a time to
+// whichever machine asks; output is passed on a line at a time.
+//
+// A root machine that halts without joining its siblings waits for them
+// to stop: each one stops at its next slice boundary, or once a pending
+// read of input returns.
+//
+// Memory that others may still be reading is freed by epoch. Every block
+// deferred is stamped with the current epoch, which then moves on. A
+// machine is quiet whenever it holds nothing it read from the table
+// before: at every barrier and slice boundary, and at its interpreter's
+// safe points when asked. It then records the epoch it has reached, and
+// while it waits in EXT_JOIN or for input it counts as being past them
+// all. A block is freed once every machine is past its epoch; that is
+// looked into again each time another SIBLING_BACKLOG bytes have been
+// deferred.
+
+#define SIBLING_SLICE (1 << 20)
+#define SIBLING_BACKLOG (16 << 20)
+#define SIBLING_PARKED UINT64_MAX
+
+typedef struct Deferred {
+    void *p;
+    size_t size;
+    uint64_t epoch;
+} Deferred;
+
+typedef struct Sibling {
+    Machine vm;
+    pthread_t thread;
+    RunStatus status;
+    bool joining;           // someone has claimed the join
+    uint64_t seen;          // epoch it was last quiet in
+} Sibling;
+
+typedef struct Siblings {
+    pthread_mutex_t lock;   // table, region, `sibs`, `deferred`
+    Machine *root;
+    Mem *M;                 // the shared array table
+    uint32_t memarr_count;
+    uint32_t memarr_cap;
+    Sibling **sibs;         // by handle - 1; NULL once joined
+    uint32_t nsibs;
+    uint32_t live;          // spawned and not yet joined
+    Deferred *deferred;     // memory to free once nobody can be using it
+    size_t deferred_head;   // the oldest not yet freed
+    size_t ndeferred;
+    size_t deferred_bytes;
+    size_t reclaim_at;      // deferred_bytes to look into freeing again at
+    uint64_t epoch;
+    uint64_t root_seen;
+    atomic_bool quit;
+
+    // The console, and the byte of it being handed out.
+    IoBackend console;
+    pthread_mutex_t in_lock;
+    pthread_mutex_t out_lock;
+    const uint8_t *in_data;
+    size_t in_len;
+    size_t in_pos;
+} Siblings;
+
+// Every machine gets one of these in front of the shared console.
+typedef struct ShareIo {
+    Siblings *sh;
+    Machine *vm;
+    bool root;
+    uint8_t in;
+    uint8_t out[4096];
+} ShareIo;
+
+static void sibling_park(Siblings *sh, Machine *vm);
+static void sibling_unpark(Siblings *sh, Machine *vm);
+
+static uint8_t *share_out_span(void *ctx, size_t *cap)
+{
+    ShareIo *io = ctx;
+    *cap = sizeof(io->out);
+    return io->out;
+}
+
+static void share_out_commit(void *ctx, size_t n)
+{
+    ShareIo *io = ctx;
+    IoBackend *con = &io->sh->console;
+    const uint8_t *p = io->out;
+    pthread_mutex_lock(&io->sh->out_lock);
+    while (n) {
+        size_t cap;
+        uint8_t *span = con->out_span(con->ctx, &cap);
+        size_t k = n < cap ? n : cap;
+        memcpy(span, p, k);
+        con->out_commit(con->ctx, k);
+        p += k;
+        n -= k;
+    }
+    pthread_mutex_unlock(&io->sh->out_lock);
+}
+
+static int share_in_span(void *ctx, const uint8_t **data, size_t *len)
+{
+    ShareIo *io = ctx;
+    Siblings *sh = io->sh;
+    IoBackend *con = &sh->console;
+    int status = IO_OK;
+    // Waiting for a read, here or in whoever holds the lock, may take
+    // forever, and nothing is read from the table meanwhile.
+    bool parked = false;
+    if (pthread_mutex_trylock(&sh->in_lock) != 0) {
+        sibling_park(sh, io->vm);
+        parked = true;
+        pthread_mutex_lock(&sh->in_lock);
+    }
+    if (sh->in_pos == sh->in_len) {
+        if (!parked) {
+            sibling_park(sh, io->vm);
+            parked = true;
+        }
+        if (sh->in_data) {
+            con->in_consume(con->ctx, sh->in_len);
+            sh->in_data = NULL;
+            sh->in_len = sh->in_pos = 0;
+        }
+        status = con->in_span(con->ctx, &sh->in_data, &sh->in_len);
+        if (status != IO_OK) {
+            sh->in_data = NULL;
+            sh->in_len = 0;
+        }
+    }
+    if (status == IO_OK) {
+        io->in = sh->in_data[sh->in_pos++];
+        *data = &io->in;
+        *len = 1;
+    }
+    pthread_mutex_unlock(&sh->in_lock);
+    if (parked) {
+        sibling_unpark(sh, io->vm);
+    }
+    return status;
+}
+
+static void share_in_consume(void *ctx, size_t n)
+{
+    // The byte was taken from the console when it was handed out.
+}
+
+static void share_destroy(void *ctx)
+{
+    ShareIo *io = ctx;
+    // Only the root's closes the console; it has to outlive the siblings.
+    if (io->root) {
+        um_32_io_close(&io->sh->console);
+    }
+    free(io);
+}
+
+static void share_io(IoBackend *io, Siblings *sh, Machine *vm, bool root)
+{
+    ShareIo *sio = xcalloc(1, sizeof(ShareIo));
+    sio->sh = sh;
+    sio->vm = vm;
+    sio->root = root;
+    *io = (IoBackend){0};
+    io->ctx = sio;
+    io->out_span = share_out_span;
+    io->out_commit = share_out_commit;
+    io->in_span = share_in_span;
+    io->in_consume = share_in_consume;
+    io->destroy = share_destroy;
+    io->line_flush = true;
+}
+
+// Points a machine at the current shared table. Under the lock.
+static void sibling_view(Machine *vm, Siblings *sh)
+{
+    vm->M = sh->M;
+    vm->memarr_count = sh->memarr_count;
+    vm->memarr_cap = sh->memarr_cap;
+}
+
+// A sibling's Machine is the first thing in its Sibling.
+static uint64_t *sibling_seen(Siblings *sh, Machine *vm)
+{
+    return vm == sh->root ? &sh->root_seen : &((Sibling *)vm)->seen;
+}
+
+// Gives a machine that is between instructions, and so holds nothing it
+// read from the table, a fresh view of it. Under the lock.
+static void sibling_quiet(Siblings *sh, Machine *vm)
+{
+    sibling_view(vm, sh);
+    *sibling_seen(sh, vm) = sh->epoch;
+}
+
+// Frees whatever every machine has been quiet since. Under the lock.
+static void sibling_reclaim(Siblings *sh)
+{
+    uint64_t oldest = sh->root_seen;
+    for (uint32_t h = 0; h < sh->nsibs; h++) {
+        Sibling *s = sh->sibs[h];
+        if (s && s->seen < oldest) {
+            oldest = s->seen;
+        }
+    }
+    Region *region = &sh->root->region;
+    while (sh->deferred_head < sh->ndeferred && sh->deferred[sh->deferred_head].epoch < oldest) {
+        Deferred *d = &sh->deferred[sh->deferred_head++];
+        region_free(region, d->p, d->size);
+        sh->deferred_bytes -= d->size;
+    }
+    if (sh->deferred_head > sh->ndeferred / 2) {
+        sh->ndeferred -= sh->deferred_head;
+        memmove(sh->deferred, sh->deferred + sh->deferred_head, sizeof(Deferred) * sh->ndeferred);
+        sh->deferred_head = 0;
+    }
+    sh->reclaim_at = sh->deferred_bytes + SIBLING_BACKLOG;
+    // What is left waits on a machine that has been busy since; a root
+    // that never reaches a barrier catches up at its next safe point.
+    if (sh->deferred_bytes >= SIBLING_BACKLOG) {
+        um_32_attention = 1;
+    }
+}
+
+static void sibling_defer(Siblings *sh, void *p, size_t size)
+{
+    sh->deferred = xrealloc(sh->deferred, sizeof(Deferred) * (sh->ndeferred + 1));
+    sh->deferred[sh->ndeferred++] = (Deferred){p, size, sh->epoch++};
+    sh->deferred_bytes += size;
+}
+
+// Takes `vm` out of the reckoning while it waits, its view of the table
+// unused until sibling_unpark.
+static void sibling_park(Siblings *sh, Machine *vm)
+{
+    pthread_mutex_lock(&sh->lock);
+    *sibling_seen(sh, vm) = SIBLING_PARKED;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+static void sibling_unpark(Siblings *sh, Machine *vm)
+{
+    pthread_mutex_lock(&sh->lock);
+    sibling_quiet(sh, vm);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+// Called by the interpreter at a safe point, or by a sibling between
+// slices.
+void um_32_siblings_quiesce(Machine *vm)
+{
+    Siblings *sh = vm->siblings;
+    pthread_mutex_lock(&sh->lock);
+    sibling_quiet(sh, vm);
+    if (sh->deferred_head < sh->ndeferred) {
+        sibling_reclaim(sh);
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+// Makes `vm` the root of a set of siblings. Its array 0 must be decoded
+// and its console spans released.
+void um_32_siblings_start(Machine *vm)
+{
+    Siblings *sh = xcalloc(1, sizeof(Siblings));
+    pthread_mutex_init(&sh->lock, NULL);
+    pthread_mutex_init(&sh->in_lock, NULL);
+    pthread_mutex_init(&sh->out_lock, NULL);
+    sh->root = vm;
+    sh->M = vm->M;
+    sh->memarr_count = vm->memarr_count;
+    sh->memarr_cap = vm->memarr_cap;
+    sh->console = vm->io;
+    share_io(&vm->io, sh, vm, true);
+    vm->siblings = sh;
+}
+
+static void *sibling_main(void *arg)
+{
+    Sibling *s = arg;
+    Siblings *sh = s->vm.siblings;
+    RunStatus status;
+    do {
+        status = um_32_run(&s->vm, SIBLING_SLICE);
+        um_32_siblings_quiesce(&s->vm);
+    } while (status != RUN_HALTED && status != RUN_FAILED && !atomic_load(&sh->quit));
+    s->status = status;
+    um_32_flush_output(&s->vm);
+    // Stopped, it holds up nothing while it waits to be joined.
+    sibling_park(sh, &s->vm);
+    return NULL;
+}
+
+bool um_32_spawn(Machine *vm, uint32_t pc, uint32_t reg, uint32_t *handle)
+{
+    Siblings *sh = vm->siblings;
+    if (pc > vm->M[0].len) {
+        return false;
+    }
+    Sibling *s = xcalloc(1, sizeof(Sibling));
+    s->vm.PC = pc;
+    memcpy(s->vm.R, vm->R, sizeof(vm->R));
+    s->vm.R[reg] = 0;
+    s->vm.code = vm->code;
+    s->vm.ext = true;
+    s->vm.siblings = sh;
+    share_io(&s->vm.io, sh, &s->vm, false);
+
+    pthread_mutex_lock(&sh->lock);
+    if (sh->nsibs == UINT32_MAX - 1) {
+        pthread_mutex_unlock(&sh->lock);
+        um_32_io_close(&s->vm.io);
+        free(s);
+        return false;
+    }
+    sibling_quiet(sh, &s->vm);
+    sh->sibs = xrealloc(sh->sibs, sizeof(Sibling *) * (sh->nsibs + 1));
+    sh->sibs[sh->nsibs++] = s;
+    sh->live++;
+    *handle = sh->nsibs;
+    // Under the lock, so nobody can join it before it exists.
+    if (pthread_create(&s->thread, NULL, sibling_main, s) != 0) {
+        perror("starting sibling");
+        exit(1);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return true;
+}
+
+bool um_32_join(Machine *vm, uint32_t handle, uint32_t reg, uint32_t *result)
+{
+    Siblings *sh = vm->siblings;
+    pthread_mutex_lock(&sh->lock);
+    Sibling *s = handle && handle <= sh->nsibs ? sh->sibs[handle - 1] : NULL;
+    // Joining oneself, or what someone else is joining, would never end.
+    if (!s || &s->vm == vm || s->joining) {
+        pthread_mutex_unlock(&sh->lock);
+        return false;
+    }
+    s->joining = true;
+    *sibling_seen(sh, vm) = SIBLING_PARKED;
+    pthread_mutex_unlock(&sh->lock);
+
+    pthread_join(s->thread, NULL);
+    bool ok = s->status == RUN_HALTED;
+    if (s->status == RUN_FAILED) {
+        fprintf(stderr, "** sibling %u failed\n", handle);
+        um_32_print_fault(&s->vm);
+    }
+    *result = s->vm.R[reg];
+    um_32_io_close(&s->vm.io);
+
+    pthread_mutex_lock(&sh->lock);
+    sh->sibs[handle - 1] = NULL;
+    sh->live--;
+    sibling_quiet(sh, vm);
+    if (sh->deferred_head < sh->ndeferred) {
+        sibling_reclaim(sh);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    free(s);
+    return ok;
+}
+
+// Hands the root back sole ownership of everything once it has joined
+// the last sibling. Returns whether it did.
+bool um_32_siblings_end(Machine *vm)
+{
+    Siblings *sh = vm->siblings;
+    if (!sh || sh->root != vm || sh->live) {
+        return false;
+    }
+    // The root's last input span was a byte of ShareIo's, already taken.
+    um_32_flush_output(vm);
+    vm->in_base = vm->in_ptr = vm->in_end = NULL;
+    IoBackend share = vm->io;
+    vm->io = sh->console;
+    if (sh->in_data) {
+        sh->console.in_consume(sh->console.ctx, sh->in_pos);
+    }
+    ((ShareIo *)share.ctx)->root = false;
+    um_32_io_close(&share);
+
+    sibling_view(vm, sh);
+    for (size_t i = sh->deferred_head; i < sh->ndeferred; i++) {
+        region_free(&vm->region, sh->deferred[i].p, sh->deferred[i].size);
+    }
+    free(sh->deferred);
+    free(sh->sibs);
+    pthread_mutex_destroy(&sh->lock);
+    pthread_mutex_destroy(&sh->in_lock);
+    pthread_mutex_destroy(&sh->out_lock);
+    free(sh);
+    vm->siblings = NULL;
+    return true;
+}
+
+// Stops and joins whatever siblings are left, then ends them.
+void um_32_siblings_stop(Machine *vm)
+{
+    Siblings *sh = vm->siblings;
+    if (!sh || sh->root != vm) {
+        return;
+    }
+    atomic_store(&sh->quit, true);
+    // Stopping siblings may still spawn others before they notice.
+    pthread_mutex_lock(&sh->lock);
+    for (uint32_t h = 1; h <= sh->nsibs; h++) {
+        Sibling *s = sh->sibs[h - 1];
+        if (s && !s->joining) {
+            pthread_mutex_unlock(&sh->lock);
+            uint32_t result;
+            um_32_join(vm, h, 0, &result);
+            pthread_mutex_lock(&sh->lock);
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+    um_32_siblings_end(vm);
+}
+
+uint32_t um_32_siblings_alloc(Machine *vm, uint32_t len)
+{
+    Siblings *sh = vm->siblings;
+    Region *region = &sh->root->region;
+    pthread_mutex_lock(&sh->lock);
+    if (sh->memarr_count == sh->memarr_cap) {
+        // Others may still be looking at the old table, so it stays.
+        uint32_t cap = sh->memarr_cap * 2;
+        Mem *table = region_alloc(region, sizeof(Mem) * cap);
+        memcpy(table, sh->M, sizeof(Mem) * sh->memarr_count);
+        sibling_defer(sh, sh->M, sizeof(Mem) * sh->memarr_cap);
+        sh->M = table;
+        sh->memarr_cap = cap;
+    }
+    uint32_t idx = sh->memarr_count++;
+    sh->M[idx].inst = region_calloc(region, len * 4);
+    sh->M[idx].len = len;
+    // Others may be reading the flag racily, to find out they need a
+    // fresh view of the table.
+    __atomic_store_n(&sh->M[idx].active, true, __ATOMIC_RELAXED);
+    sibling_quiet(sh, vm);
+    if (sh->deferred_bytes >= sh->reclaim_at) {
+        sibling_reclaim(sh);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    UM_32_PROBE2(alloc, idx, len);
+    return idx;
+}
+
+bool um_32_siblings_abandon(Machine *vm, uint32_t idx)
+{
+    Siblings *sh = vm->siblings;
+    pthread_mutex_lock(&sh->lock);
+    bool ok = idx != 0 && idx < sh->memarr_count && sh->M[idx].active;
+    uint32_t len = ok ? sh->M[idx].len : 0;
+    if (ok) {
+        __atomic_store_n(&sh->M[idx].active, false, __ATOMIC_RELAXED);
+        sibling_defer(sh, sh->M[idx].inst, sh->M[idx].len * 4);
+    }
+    sibling_quiet(sh, vm);
+    if (sh->deferred_bytes >= sh->reclaim_at) {
+        sibling_reclaim(sh);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    if (ok) {
+        UM_32_PROBE2(abandon, idx, len);
+    }
+    return ok;
+}
+
+// Catches up with arrays the other machines have allocated; returns
+// whether `idx` is now a live array.
+bool um_32_siblings_refresh(Machine *vm, uint32_t idx)
+{
+    Siblings *sh = vm->siblings;
+    pthread_mutex_lock(&sh->lock);
+    sibling_quiet(sh, vm);
+    bool ok = idx < sh->memarr_count && sh->M[idx].active;
+    pthread_mutex_unlock(&sh->lock);
+    return ok;
+}
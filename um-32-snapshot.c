@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+#include "um-32.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Snapshot file layout (host byte order):
+//
+//   SnapHeader
+//   meta block     lz-compressed: uint32_t len[memarr_count],
+//                                 uint8_t active[memarr_count]
+//   chunk table    SnapChunk[nchunks]
+//   chunk data     each chunk lz-compressed, or stored if that didn't help
+//
+// The chunks cut the concatenated payloads of all active arrays into
+// SNAP_CHUNK_SIZE pieces, which are compressed and decompressed
+// independently across all cores. Restoring from a file maps the chunk
+// data rather than reading it, so the workers decompress straight out of
+// the page cache.
+#define SNAP_MAGIC      "UM32SNAP"
+#define SNAP_VERSION    1
+#define SNAP_BYTE_ORDER 0x01020304
+#define SNAP_CHUNK_SIZE (1 << 20)
+#define SNAP_MAX_THREADS 64
+
+typedef struct SnapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t PC;
+    uint32_t R[8];
+    uint32_t memarr_count;
+    uint32_t chunk_size;
+    uint32_t nchunks;
+    uint64_t meta_len;
+    uint64_t meta_comp;
+} SnapHeader;
+
+typedef struct SnapChunk {
+    uint32_t raw_len;
+    uint32_t comp_len;
+} SnapChunk;
+
+// The payload stream as a list of segments, one per active array.
+typedef struct SnapStream {
+    Machine *vm;
+    uint32_t *ids;
+    size_t *starts;
+    size_t nsegs;
+    size_t total;
+} SnapStream;
+
+typedef struct SnapJob {
+    SnapStream *stream;
+    SnapChunk *table;
+    uint8_t **data;
+    const uint8_t *in;
+    size_t *offsets;
+    atomic_size_t next;
+    size_t nchunks;
+    atomic_bool failed;
+} SnapJob;
+
+bool write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void snap_stream_init(SnapStream *s, Machine *vm)
+{
+    s->vm = vm;
+    s->ids = xmalloc(sizeof(uint32_t) * (vm->memarr_count + 1));
+    s->starts = xmalloc(sizeof(size_t) * (vm->memarr_count + 1));
+    s->nsegs = 0;
+    s->total = 0;
+    for (uint32_t i = 0; i < vm->memarr_count; i++) {
+        if (vm->M[i].active && vm->M[i].len) {
+            s->ids[s->nsegs] = i;
+            s->starts[s->nsegs] = s->total;
+            s->nsegs++;
+            s->total += vm->M[i].len * 4;
+        }
+    }
+    s->starts[s->nsegs] = s->total;
+}
+
+static void snap_stream_free(SnapStream *s)
+{
+    free(s->ids);
+    free(s->starts);
+}
+
+// Copies stream bytes [off, off + len) to or from `buf`.
+static void snap_stream_copy(SnapStream *s, size_t off, uint8_t *buf, size_t len, bool to_stream)
+{
+    size_t lo = 0;
+    size_t hi = s->nsegs;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (s->starts[mid] <= off) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    for (size_t seg = lo; len; seg++) {
+        uint8_t *base = (uint8_t *)s->vm->M[s->ids[seg]].inst;
+        size_t skip = off - s->starts[seg];
+        size_t n = s->starts[seg + 1] - off;
+        if (n > len) {
+            n = len;
+        }
+        if (to_stream) {
+            memcpy(base + skip, buf, n);
+        } else {
+            memcpy(buf, base + skip, n);
+        }
+        buf += n;
+        off += n;
+        len -= n;
+    }
+}
+
+static void run_parallel(void *(*fn)(void *), SnapJob *job)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = ncpu > 0 ? ncpu : 1;
+    if (nthreads > job->nchunks) {
+        nthreads = job->nchunks;
+    }
+    if (nthreads > SNAP_MAX_THREADS) {
+        nthreads = SNAP_MAX_THREADS;
+    }
+    pthread_t threads[SNAP_MAX_THREADS];
+    size_t started = 0;
+    for (size_t i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, fn, job) == 0) {
+            started++;
+        }
+    }
+    fn(job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void *snap_compress_worker(void *arg)
+{
+    SnapJob *job = arg;
+    uint8_t *raw = xmalloc(SNAP_CHUNK_SIZE);
+    for (;;) {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->nchunks) {
+            break;
+        }
+        size_t off = i * SNAP_CHUNK_SIZE;
+        size_t len = job->stream->total - off;
+        if (len > SNAP_CHUNK_SIZE) {
+            len = SNAP_CHUNK_SIZE;
+        }
+        snap_stream_copy(job->stream, off, raw, len, false);
+        uint8_t *out = xmalloc(lz_compress_bound(len));
+        size_t comp = lz_compress(raw, len, out, len - 1);
+        if (!comp) {
+            memcpy(out, raw, len);
+            comp = len;
+        }
+        job->table[i].raw_len = len;
+        job->table[i].comp_len = comp;
+        job->data[i] = out;
+    }
+    free(raw);
+    return NULL;
+}
+
+static void *snap_decompress_worker(void *arg)
+{
+    SnapJob *job = arg;
+    uint8_t *raw = xmalloc(SNAP_CHUNK_SIZE);
+    for (;;) {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->nchunks) {
+            break;
+        }
+        SnapChunk c = job->table[i];
+        const uint8_t *in = job->in + job->offsets[i];
+        if (c.comp_len == c.raw_len) {
+            snap_stream_copy(job->stream, i * SNAP_CHUNK_SIZE, (uint8_t *)in, c.raw_len, true);
+        } else if (lz_decompress(in, c.comp_len, raw, c.raw_len)) {
+            snap_stream_copy(job->stream, i * SNAP_CHUNK_SIZE, raw, c.raw_len, true);
+        } else {
+            atomic_store(&job->failed, true);
+        }
+    }
+    free(raw);
+    return NULL;
+}
+
+bool um_32_snapshot_write(Machine *vm, int fd)
+{
+    // Arrays are saved as they are, not as a sweep left them.
+    um_32_warm_all(vm);
+    SnapHeader h = {0};
+    memcpy(h.magic, SNAP_MAGIC, 8);
+    h.version = SNAP_VERSION;
+    h.byte_order = SNAP_BYTE_ORDER;
+    h.PC = vm->PC;
+    memcpy(h.R, vm->R, sizeof(h.R));
+    h.memarr_count = vm->memarr_count;
+    h.chunk_size = SNAP_CHUNK_SIZE;
+
+    h.meta_len = (size_t)vm->memarr_count * 5;
+    uint8_t *meta = xmalloc(h.meta_len);
+    uint8_t *active = meta + (size_t)vm->memarr_count * 4;
+    for (uint32_t i = 0; i < vm->memarr_count; i++) {
+        uint32_t len = vm->M[i].len;
+        memcpy(meta + (size_t)i * 4, &len, 4);
+        active[i] = vm->M[i].active;
+    }
+    uint8_t *meta_comp = xmalloc(lz_compress_bound(h.meta_len));
+    h.meta_comp = lz_compress(meta, h.meta_len, meta_comp, lz_compress_bound(h.meta_len));
+    free(meta);
+
+    SnapStream stream;
+    snap_stream_init(&stream, vm);
+    h.nchunks = (stream.total + SNAP_CHUNK_SIZE - 1) / SNAP_CHUNK_SIZE;
+    SnapJob job = {0};
+    job.stream = &stream;
+    job.nchunks = h.nchunks;
+    job.table = xcalloc(h.nchunks + 1, sizeof(SnapChunk));
+    job.data = xcalloc(h.nchunks + 1, sizeof(uint8_t *));
+    run_parallel(snap_compress_worker, &job);
+
+    bool ok = write_all(fd, &h, sizeof(h)) &&
+              write_all(fd, meta_comp, h.meta_comp) &&
+              write_all(fd, job.table, sizeof(SnapChunk) * h.nchunks);
+    for (size_t i = 0; i < h.nchunks; i++) {
+        ok = ok && write_all(fd, job.data[i], job.table[i].comp_len);
+        free(job.data[i]);
+    }
+    free(job.data);
+    free(job.table);
+    free(meta_comp);
+    snap_stream_free(&stream);
+    return ok;
+}
+
+// Restores a snapshot into a fresh or reset machine.
+bool um_32_snapshot_read(Machine *vm, int fd)
+{
+    SnapHeader h;
+    if (!read_all(fd, &h, sizeof(h))) {
+        return false;
+    }
+    if (memcmp(h.magic, SNAP_MAGIC, 8) != 0 || h.version != SNAP_VERSION ||
+        h.byte_order != SNAP_BYTE_ORDER || h.chunk_size != SNAP_CHUNK_SIZE ||
+        h.memarr_count == 0 || h.meta_len != (uint64_t)h.memarr_count * 5) {
+        errno = EINVAL;
+        return false;
+    }
+
+    uint8_t *meta_comp = xmalloc(h.meta_comp);
+    uint8_t *meta = xmalloc(h.meta_len);
+    bool ok = read_all(fd, meta_comp, h.meta_comp) &&
+              lz_decompress(meta_comp, h.meta_comp, meta, h.meta_len);
+    free(meta_comp);
+    if (!ok) {
+        free(meta);
+        errno = EINVAL;
+        return false;
+    }
+
+    vm->PC = h.PC;
+    memcpy(vm->R, h.R, sizeof(h.R));
+    vm->memarr_cap = 64;
+    while (vm->memarr_cap < h.memarr_count) {
+        vm->memarr_cap *= 2;
+    }
+    vm->M = region_alloc(&vm->region, sizeof(Mem) * vm->memarr_cap);
+    vm->memarr_count = h.memarr_count;
+    const uint8_t *active = meta + (size_t)h.memarr_count * 4;
+    for (uint32_t i = 0; i < h.memarr_count; i++) {
+        uint32_t len;
+        memcpy(&len, meta + (size_t)i * 4, 4);
+        vm->M[i].len = len;
+        vm->M[i].active = active[i];
+        if (i == 0) {
+            vm->M[i].inst = um_32_alloc_program(vm, len);
+        } else {
+            vm->M[i].inst = active[i] ? region_alloc(&vm->region, (size_t)len * 4) : NULL;
+        }
+    }
+    free(meta);
+    if (!vm->M[0].active || vm->PC > vm->M[0].len) {
+        errno = EINVAL;
+        return false;
+    }
+
+    SnapStream stream;
+    snap_stream_init(&stream, vm);
+    SnapJob job = {0};
+    job.stream = &stream;
+    job.nchunks = h.nchunks;
+    job.table = xcalloc(h.nchunks + 1, sizeof(SnapChunk));
+    job.offsets = xcalloc(h.nchunks + 1, sizeof(size_t));
+    ok = h.nchunks == (stream.total + SNAP_CHUNK_SIZE - 1) / SNAP_CHUNK_SIZE &&
+         read_all(fd, job.table, sizeof(SnapChunk) * h.nchunks);
+    size_t total = 0;
+    for (size_t i = 0; ok && i < h.nchunks; i++) {
+        size_t expect = stream.total - i * SNAP_CHUNK_SIZE;
+        if (expect > SNAP_CHUNK_SIZE) {
+            expect = SNAP_CHUNK_SIZE;
+        }
+        ok = job.table[i].raw_len == expect && job.table[i].comp_len <= expect;
+        job.offsets[i] = total;
+        total += job.table[i].comp_len;
+    }
+    uint8_t *in = NULL;
+    uint8_t *map = MAP_FAILED;
+    size_t map_len = 0;
+    if (ok) {
+        // Pages of the mapping past the end of a truncated file would
+        // fault on first touch rather than fail the read.
+        off_t at = lseek(fd, 0, SEEK_CUR);
+        struct stat st;
+        if (at >= 0 && total && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            map_len = at + total;
+            if ((uint64_t)st.st_size < map_len) {
+                ok = false;
+            } else {
+                map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            }
+        }
+        if (map != MAP_FAILED) {
+            job.in = map + at;
+        } else if (ok) {
+            in = xmalloc(total + 1);
+            ok = read_all(fd, in, total);
+            job.in = in;
+        }
+    }
+    if (ok) {
+        run_parallel(snap_decompress_worker, &job);
+        ok = !atomic_load(&job.failed);
+    }
+    if (map != MAP_FAILED) {
+        munmap(map, map_len);
+    }
+    free(in);
+    free(job.offsets);
+    free(job.table);
+    snap_stream_free(&stream);
+    if (!ok) {
+        errno = EINVAL;
+        return false;
+    }
+    vm->halted = false;
+    um_32_predecode(vm);
+    return true;
+}
+
+bool um_32_snapshot_save(Machine *vm, const char *path)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = um_32_snapshot_write(vm, fd);
+    ok = close(fd) == 0 && ok;
+    if (ok) {
+        ok = rename(tmp, path) == 0;
+    } else {
+        unlink(tmp);
+    }
+    return ok;
+}
+
+bool um_32_snapshot_load(Machine *vm, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = um_32_snapshot_read(vm, fd);
+    close(fd);
+    return ok;
+}
+
+// Writes a machine out to `fd` and gives back all its memory; the rest of
+// the Machine (console, counters, settings) stays as it is. The machine
+// must be stopped between instructions with no console spans out.
+bool um_32_hibernate(Machine *vm, int fd)
+{
+    if (!um_32_snapshot_write(vm, fd)) {
+        return false;
+    }
+    um_32_shutdown(vm);
+    vm->code = NULL;
+    vm->pending = NULL;
+    return true;
+}
+
+// Brings back a machine um_32_hibernate wrote to `fd`.
+bool um_32_wake(Machine *vm, int fd)
+{
+    return lseek(fd, 0, SEEK_SET) == 0 && um_32_snapshot_read(vm, fd);
+}
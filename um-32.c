@@ -1,60 +1,14 @@
 #define _GNU_SOURCE
-#include <errno.h>
-#include <stdint.h>
-#include <string.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <assert.h>
-#include <stdbool.h>
-#include <ctype.h>
-
-typedef struct Buffer {
-    uint8_t *data;
-    size_t len;
-} Buffer;
+#include "um-32.h"
+#include "um-32-probes.h"
+#include <time.h>
+#include <sys/time.h>
 
 void free_buffer(Buffer b)
 {
     free(b.data);
 }
 
-typedef struct Mem {
-    uint32_t *inst;
-    size_t len;
-    bool active;
-} Mem;
-
-void free_mem(Mem m)
-{
-    free(m.inst);
-}
-
-// Machine state
-uint32_t PC;
-uint32_t R[8];  // registers
-Mem *M;         // memory arrays
-uint32_t memarr_count;
-bool halted;
-
-typedef enum Op {
-    CMOV,
-    ARRAY_INDEX,
-    ARRAY_AMEND,
-    ADD,
-    MUL,
-    DIV,
-    NAND,
-    HALT,
-    ALLOC,
-    ABANDON,
-    OUTPUT,
-    INPUT,
-    LOAD_PROG,
-    ORTHOG,
-
-    NUM_OPS,
-} Op;
-
 const char *op_names[] = {
     "cmov",
     "arrind",
@@ -110,13 +64,477 @@ void *xrealloc(void *oldptr, size_t newsize)
     return ptr;
 }
 
-static void um_32_init(Buffer prog)
+static Chunk *region_new_chunk(size_t size)
+{
+    Chunk *c = xcalloc(1, sizeof(Chunk) + size);
+    c->size = size;
+    return c;
+}
+
+void *region_alloc(Region *r, size_t size)
+{
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    if (size > REGION_LARGE_SIZE) {
+        Chunk *c = region_new_chunk(size);
+        r->held += size;
+        c->used = size;
+        c->next = r->large;
+        if (r->large) {
+            r->large->prev = c;
+        }
+        r->large = c;
+        return c->data;
+    }
+    Chunk *c = r->cur;
+    while (c && c->used + size > c->size) {
+        c = c->next;
+        if (c) {
+            c->used = 0;
+        }
+    }
+    if (!c) {
+        c = region_new_chunk(REGION_CHUNK_SIZE);
+        r->held += REGION_CHUNK_SIZE;
+        if (r->cur) {
+            r->cur->next = c;
+            c->prev = r->cur;
+        } else {
+            r->first = c;
+        }
+    }
+    r->cur = c;
+    void *ptr = (uint8_t *)c->data + c->used;
+    c->used += size;
+    return ptr;
+}
+
+// Like region_alloc, but zero-filled. Large chunks come straight from
+// calloc, so only recycled small memory needs clearing.
+void *region_calloc(Region *r, size_t size)
+{
+    void *ptr = region_alloc(r, size);
+    if (size <= REGION_LARGE_SIZE) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+static Chunk *region_unlink_large(Region *r, void *ptr)
+{
+    Chunk *c = (Chunk *)((uint8_t *)ptr - offsetof(Chunk, data));
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        r->large = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    r->held -= c->size;
+    return c;
+}
+
+// Returns a large allocation to the system right away; small allocations
+// stay put until the region is reset or released.
+void region_free(Region *r, void *ptr, size_t size)
+{
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    if (!ptr || size <= REGION_LARGE_SIZE) {
+        return;
+    }
+    free(region_unlink_large(r, ptr));
+}
+
+// Moves an allocation from `src` to `dst`. A large one takes its chunk
+// along and stays where it is; a small one is copied.
+static void *region_move(Region *dst, Region *src, void *ptr, size_t size)
+{
+    size_t rounded = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    if (rounded <= REGION_LARGE_SIZE) {
+        void *copy = region_alloc(dst, size);
+        memcpy(copy, ptr, size);
+        return copy;
+    }
+    Chunk *c = region_unlink_large(src, ptr);
+    c->prev = NULL;
+    c->next = dst->large;
+    if (dst->large) {
+        dst->large->prev = c;
+    }
+    dst->large = c;
+    dst->held += c->size;
+    return ptr;
+}
+
+static void region_free_large(Region *r)
+{
+    while (r->large) {
+        Chunk *c = r->large;
+        r->large = c->next;
+        r->held -= c->size;
+        free(c);
+    }
+}
+
+// Rewinds the region to empty while keeping its small chunks for reuse.
+void region_reset(Region *r)
+{
+    region_free_large(r);
+    r->cur = r->first;
+    if (r->cur) {
+        r->cur->used = 0;
+    }
+}
+
+void region_release(Region *r)
+{
+    region_free_large(r);
+    while (r->first) {
+        Chunk *c = r->first;
+        r->first = c->next;
+        free(c);
+    }
+    r->cur = NULL;
+    r->held = 0;
+}
+
+Decoded um_32_decode(uint32_t inst)
+{
+    Decoded d;
+    d.op = (inst >> 28) & 0xf;
+    if (d.op == ORTHOG) {
+        d.a = (inst >> 25) & 0x7;
+        d.b = 0;
+        d.c = 0;
+        d.val = inst & 0x1ffffff;
+    } else {
+        d.a = (inst >>  6) & 0x7;
+        d.b = (inst >>  3) & 0x7;
+        d.c = (inst >>  0) & 0x7;
+        d.val = d.op == EXT ? (inst >> 9) & 0x7ffff : 0;
+    }
+    return d;
+}
+
+// The helper thread is shared by every machine in the process: jobs queue
+// up and are decoded in turn, and the thread exits once the queue has been
+// empty for DECODE_LINGER_NS, to be started again by the next submission.
+// A host running many sessions thus has at most one helper, and an idle
+// process has none; a guest loading one program after another (as the
+// Codex does) doesn't pay for a new thread each time.
+#define DECODE_LINGER_NS 100000000
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // a job finished, or the thread exited
+    pthread_cond_t work;        // a job was queued, or `quit` set
+    pthread_t thread;
+    bool running;
+    bool joinable;              // `thread` has exited but not been joined
+    bool quit;                  // exit as soon as the queue is empty
+    Decoder *head;
+    Decoder *tail;
+} decode_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void *um_32_decoder_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&decode_pool.lock);
+    for (;;) {
+        if (!decode_pool.head) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += DECODE_LINGER_NS;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            while (!decode_pool.head && !decode_pool.quit &&
+                   pthread_cond_timedwait(&decode_pool.work, &decode_pool.lock, &until) == 0) {
+            }
+            if (!decode_pool.head) {
+                break;
+            }
+        }
+        Decoder *dec = decode_pool.head;
+        decode_pool.head = dec->next;
+        if (!decode_pool.head) {
+            decode_pool.tail = NULL;
+        }
+        dec->queued = false;
+        const uint32_t *src = dec->src;
+        Decoded *out = dec->out;
+        size_t len = dec->len;
+        pthread_mutex_unlock(&decode_pool.lock);
+
+        // The interpreter may amend array 0 under our feet; each platter is
+        // read once with a relaxed load and any cell amended meanwhile is
+        // re-decoded from the amend log before the result is used.
+        bool cancelled = false;
+        for (size_t i = 0; i < len; i++) {
+            if ((i & 0xfff) == 0 && atomic_load_explicit(&dec->cancel, memory_order_relaxed)) {
+                cancelled = true;
+                break;
+            }
+            uint32_t inst = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+            out[i] = um_32_decode(inst);
+        }
+
+        pthread_mutex_lock(&decode_pool.lock);
+        dec->busy = false;
+        if (!cancelled) {
+            atomic_store_explicit(&dec->ready, true, memory_order_release);
+        }
+        pthread_cond_broadcast(&decode_pool.cond);
+    }
+    decode_pool.running = false;
+    pthread_cond_broadcast(&decode_pool.cond);
+    pthread_mutex_unlock(&decode_pool.lock);
+    return NULL;
+}
+
+// Abandons any decode job of this machine's, taking it off the queue if
+// the helper hasn't got to it yet, or else waiting for the helper to let go
+// of the array it was reading.
+static void um_32_decoder_cancel(Machine *vm)
+{
+    Decoder *dec = &vm->decoder;
+    if (dec->submitted) {
+        pthread_mutex_lock(&decode_pool.lock);
+        if (dec->queued) {
+            Decoder **p = &decode_pool.head, *prev = NULL;
+            while (*p != dec) {
+                prev = *p;
+                p = &(*p)->next;
+            }
+            *p = dec->next;
+            if (decode_pool.tail == dec) {
+                decode_pool.tail = prev;
+            }
+            dec->queued = false;
+            dec->busy = false;
+        } else if (dec->busy) {
+            atomic_store_explicit(&dec->cancel, true, memory_order_relaxed);
+            while (dec->busy) {
+                pthread_cond_wait(&decode_pool.cond, &decode_pool.lock);
+            }
+        }
+        atomic_store_explicit(&dec->cancel, false, memory_order_relaxed);
+        atomic_store_explicit(&dec->ready, false, memory_order_relaxed);
+        pthread_mutex_unlock(&decode_pool.lock);
+        dec->submitted = false;
+    }
+    if (vm->pending) {
+        region_free(&vm->region, vm->pending, sizeof(Decoded) * (dec->len + 1));
+        vm->pending = NULL;
+    }
+}
+
+// Waits for the helper to run out of work and exit, so that nothing but
+// the calling thread is left in the process.
+static void um_32_decoder_drain(void)
+{
+    pthread_mutex_lock(&decode_pool.lock);
+    decode_pool.quit = true;
+    pthread_cond_broadcast(&decode_pool.work);
+    while (decode_pool.running) {
+        pthread_cond_wait(&decode_pool.cond, &decode_pool.lock);
+    }
+    decode_pool.quit = false;
+    bool join = decode_pool.joinable;
+    pthread_t thread = decode_pool.thread;
+    decode_pool.joinable = false;
+    pthread_mutex_unlock(&decode_pool.lock);
+    if (join) {
+        pthread_join(thread, NULL);
+    }
+}
+
+static void um_32_decoder_submit(Machine *vm)
+{
+    Decoder *dec = &vm->decoder;
+    pthread_mutex_lock(&decode_pool.lock);
+    dec->src = vm->M[0].inst;
+    dec->out = vm->pending;
+    dec->len = vm->M[0].len;
+    dec->busy = true;
+    dec->queued = true;
+    dec->next = NULL;
+    dec->gen = 0;
+    if (decode_pool.tail) {
+        decode_pool.tail->next = dec;
+    } else {
+        decode_pool.head = dec;
+    }
+    decode_pool.tail = dec;
+    if (decode_pool.running) {
+        pthread_cond_signal(&decode_pool.work);
+    } else {
+        if (decode_pool.joinable) {
+            pthread_join(decode_pool.thread, NULL);
+        }
+        if (pthread_create(&decode_pool.thread, NULL, um_32_decoder_main, NULL) != 0) {
+            perror("starting decoder thread");
+            exit(1);
+        }
+        decode_pool.running = true;
+        decode_pool.joinable = true;
+    }
+    pthread_mutex_unlock(&decode_pool.lock);
+    dec->submitted = true;
+}
+
+// Allocates storage for a `len` platter array 0, followed by the trap
+// sentinel that makes running off its end Fail without a per-cycle check.
+uint32_t *um_32_alloc_program(Machine *vm, size_t len)
+{
+    uint32_t *inst = region_alloc(&vm->region, 4 * (len + 1));
+    inst[len] = TRAP_SENTINEL;
+    return inst;
+}
+
+// Verifies and decodes array 0; called whenever it is replaced. Cells
+// with opcode 14 or 15 keep that opcode, which the dispatch switch routes
+// straight to the trap (or for 14, on a machine with `ext` set, to the
+// EXT operations), so neither they nor the sentinel need a check in the
+// spin loop. The previous decoded form is dropped and the machine runs
+// undecoded until the new one is available.
+// um.um, the self-interpreter, keeps its guest's registers in words 0-7 of
+// its own array 0 and the guest's array 0 from word 256 on. Every guest
+// instruction ends with a jump back to the dispatch at word 18, with the
+// guest's finger (plus 256) in r0. Words 8-255 are the interpreter proper
+// and are what we recognise it by.
+#define NESTED_REGS      8
+#define NESTED_IMAGE_LEN 256
+#define NESTED_DISPATCH  18
+#define NESTED_IMAGE_HASH 0x736b8dab1175e2f6ull
+
+static bool um_32_nested_image(const uint32_t *inst, size_t len)
+{
+    if (len < NESTED_IMAGE_LEN) {
+        return false;
+    }
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = NESTED_REGS; i < NESTED_IMAGE_LEN; i++) {
+        h ^= inst[i];
+        h *= 0x100000001b3ull;
+    }
+    return h == NESTED_IMAGE_HASH;
+}
+
+void um_32_predecode(Machine *vm)
+{
+    um_32_decoder_cancel(vm);
+    vm->nested = um_32_nested_image(vm->M[0].inst, vm->M[0].len);
+    if (vm->code) {
+        region_free(&vm->region, vm->code, sizeof(Decoded) * (vm->decoder.len + 1));
+        vm->code = NULL;
+    }
+    size_t len = vm->M[0].len;
+    vm->decoder.len = len;
+    vm->pending = region_alloc(&vm->region, sizeof(Decoded) * (len + 1));
+    vm->pending[len] = um_32_decode(TRAP_SENTINEL);
+    if (len < DECODE_ASYNC_MIN) {
+        for (size_t i = 0; i < len; i++) {
+            vm->pending[i] = um_32_decode(vm->M[0].inst[i]);
+        }
+        vm->code = vm->pending;
+        vm->pending = NULL;
+        return;
+    }
+    um_32_decoder_submit(vm);
+}
+
+// Decodes array 0 on the spot if the helper hasn't finished with it.
+static void um_32_decode_now(Machine *vm)
+{
+    if (!vm->pending) {
+        return;
+    }
+    um_32_decoder_cancel(vm);
+    size_t len = vm->M[0].len;
+    Decoded *code = region_alloc(&vm->region, sizeof(Decoded) * (len + 1));
+    for (size_t i = 0; i <= len; i++) {
+        code[i] = um_32_decode(vm->M[0].inst[i]);
+    }
+    vm->decoder.len = len;
+    vm->code = code;
+}
+
+// Finishes decoding array 0 and waits out the helper thread, so the
+// process can fork with the machine whole.
+void um_32_quiesce(Machine *vm)
+{
+    um_32_decode_now(vm);
+    um_32_decoder_drain();
+}
+
+// Safe point: switches to the decoded form once the helper is done,
+// replaying the amendments made to array 0 in the meantime. If there were
+// too many to log, the job is simply run again.
+static void um_32_adopt_code(Machine *vm)
+{
+    Decoder *dec = &vm->decoder;
+    if (!atomic_load_explicit(&dec->ready, memory_order_acquire)) {
+        return;
+    }
+    atomic_store_explicit(&dec->ready, false, memory_order_relaxed);
+    if (dec->gen > DECODE_AMEND_LOG) {
+        um_32_decoder_submit(vm);
+        return;
+    }
+    for (uint32_t i = 0; i < dec->gen; i++) {
+        uint32_t off = dec->amend_log[i];
+        vm->pending[off] = um_32_decode(__atomic_load_n(&vm->M[0].inst[off], __ATOMIC_RELAXED));
+    }
+    vm->code = vm->pending;
+    vm->pending = NULL;
+}
+
+// Re-verifies the one cell of array 0 written by an ARRAY_AMEND, keeping
+// the decoded form (or the job producing it) in step.
+static void um_32_amend_code(Machine *vm, uint32_t off)
+{
+    if (off >= NESTED_REGS && off < NESTED_IMAGE_LEN) {
+        vm->nested = false;
+    }
+    if (off >= vm->M[0].len) {
+        if (off == vm->M[0].len) {
+            __atomic_store_n(&vm->M[0].inst[off], TRAP_SENTINEL, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    if (vm->code) {
+        Decoded d = um_32_decode(__atomic_load_n(&vm->M[0].inst[off], __ATOMIC_RELAXED));
+        __atomic_store(&vm->code[off], &d, __ATOMIC_RELAXED);
+    } else if (vm->pending) {
+        Decoder *dec = &vm->decoder;
+        if (dec->gen < DECODE_AMEND_LOG) {
+            dec->amend_log[dec->gen] = off;
+        }
+        if (dec->gen <= DECODE_AMEND_LOG) {
+            dec->gen++;
+        }
+    }
+}
+
+static void um_32_boot(Machine *vm, Mem m0)
+{
+    vm->PC = 0;
+    memset(vm->R, 0, 4 * 8);
+    vm->memarr_cap = 64;
+    vm->M = region_alloc(&vm->region, sizeof(Mem) * vm->memarr_cap);
+    vm->memarr_count = 1;
+    vm->M[0] = m0;
+    vm->halted = false;
+    um_32_predecode(vm);
+}
+
+void um_32_init(Machine *vm, Buffer prog)
 {
-    PC = 0;
-    memset(R, 0, 4 * 8);
     Mem m0 = {0};
     uint32_t ninst = prog.len / 4;
-    m0.inst = xmalloc(4 * ninst);
+    m0.inst = um_32_alloc_program(vm, ninst);
     m0.len = ninst;
     m0.active = true;
     for (int i = 0; i < prog.len; i += 4) {
@@ -126,17 +544,101 @@ static void um_32_init(Buffer prog)
                         prog.data[i + 3] <<  0 ;
         m0.inst[i/4] = inst;
     }
-    M = xmalloc(sizeof(Mem));
-    memarr_count = 1;
-    M[0] = m0;
-    halted = false;
+    um_32_boot(vm, m0);
+}
+
+// Like um_32_init, for a program already in platters.
+void um_32_init_words(Machine *vm, const uint32_t *words, size_t len)
+{
+    Mem m0 = {0};
+    m0.inst = um_32_alloc_program(vm, len);
+    m0.len = len;
+    m0.active = true;
+    memcpy(m0.inst, words, len * 4);
+    um_32_boot(vm, m0);
 }
 
-static void um_32_print_debug_state(void)
+// Drops all machine state in one go so the machine can be re-initialized
+// with a new program, reusing the memory it already holds.
+void um_32_reset(Machine *vm)
 {
-    printf("PC=%u ", PC);
+    um_32_decoder_cancel(vm);
+    um_32_cold_free(vm);
+    region_reset(&vm->region);
+    vm->code = NULL;
+    vm->M = NULL;
+    vm->memarr_count = 0;
+    vm->memarr_cap = 0;
+    vm->halted = true;
+}
+
+static double um_32_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Moves the array table, every live array and the decoded program into a
+// fresh region and drops the old one, and with it everything abandoned
+// since. Small arrays end up packed together in identifier order, which
+// is the order they were allocated in; large ones keep their own chunks,
+// and cold ones go along as they are. Only at a safe point, and not while
+// the decoder is reading array 0.
+static void um_32_compact(Machine *vm)
+{
+    if (vm->pending) {
+        return;
+    }
+    double t0 = um_32_now();
+    Region old = vm->region;
+    Region fresh = {0};
+    size_t before = old.held;
+    size_t live = sizeof(Mem) * vm->memarr_cap;
+    Mem *table = region_move(&fresh, &old, vm->M, live);
+    for (uint32_t i = 0; i < vm->memarr_count; i++) {
+        Mem *m = &table[i];
+        size_t size = um_32_cold_size(vm, i);
+        if (!m->active && !size) {
+            // Abandoned, unless a sweep keeps it outside the region.
+            if (!um_32_cold_apart(vm, i)) {
+                m->inst = NULL;
+            }
+            continue;
+        }
+        // Array 0 takes its trap sentinel along.
+        if (m->active) {
+            size = (i == 0 ? m->len + 1 : m->len) * 4;
+        }
+        m->inst = region_move(&fresh, &old, m->inst, size);
+        live += size;
+    }
+    if (vm->code) {
+        size_t size = sizeof(Decoded) * (vm->decoder.len + 1);
+        vm->code = region_move(&fresh, &old, vm->code, size);
+        live += size;
+    }
+    vm->M = table;
+    region_release(&old);
+    vm->region = fresh;
+
+    CompactStats *st = &vm->compact;
+    st->runs++;
+    st->seconds += um_32_now() - t0;
+    st->held_before += before;
+    st->held_after += fresh.held;
+    st->live += live;
+    vm->compact_at = fresh.held * vm->compact_ratio;
+    if (vm->compact_at < COMPACT_MIN_HELD) {
+        vm->compact_at = COMPACT_MIN_HELD;
+    }
+}
+
+static void um_32_print_debug_state(Machine *vm)
+{
+    printf("PC=%u ", vm->PC);
     for (int i = 0; i < 8; i++) {
-        printf("R[%d]=%u ", i, R[i]);
+        printf("R[%d]=%u ", i, vm->R[i]);
     }
     printf("\n");
 }
@@ -151,153 +653,740 @@ static void um_32_print_debug_inst(uint32_t inst)
     printf("%s\tA:%d\tB:%d\tC:%d\n", name, reg_a, reg_b, reg_c);
 }
 
-#define EXCEPTION(inst) { \
-    um_32_print_debug_inst(inst); \
-    um_32_print_debug_state(); \
-    assert(false); \
+static void um_32_grow_table(Machine *vm)
+{
+    uint32_t cap = vm->memarr_cap * 2;
+    Mem *table = region_alloc(&vm->region, sizeof(Mem) * cap);
+    memcpy(table, vm->M, sizeof(Mem) * vm->memarr_count);
+    region_free(&vm->region, vm->M, sizeof(Mem) * vm->memarr_cap);
+    vm->M = table;
+    if (vm->dirty) {
+        vm->dirty = xrealloc(vm->dirty, cap);
+        memset(vm->dirty + vm->memarr_cap, 0, cap - vm->memarr_cap);
+    }
+    if (vm->cold) {
+        vm->cold->state = xrealloc(vm->cold->state, cap);
+        memset(vm->cold->state + vm->memarr_cap, 0, cap - vm->memarr_cap);
+        vm->cold->uses = xrealloc(vm->cold->uses, sizeof(uint32_t) * cap);
+    }
+    vm->memarr_cap = cap;
+}
+
+// Hands everything written into the current output span to the backend.
+void um_32_flush_output(Machine *vm)
+{
+    if (vm->out_ptr != vm->out_base) {
+        UM_32_PROBE1(output_flush, vm->out_ptr - vm->out_base);
+        vm->io.out_commit(vm->io.ctx, vm->out_ptr - vm->out_base);
+    }
+    vm->out_base = vm->out_ptr = vm->out_end = NULL;
+}
+
+static void um_32_next_output_span(Machine *vm)
+{
+    um_32_flush_output(vm);
+    size_t cap = 0;
+    vm->out_base = vm->io.out_span(vm->io.ctx, &cap);
+    vm->out_ptr = vm->out_base;
+    vm->out_end = vm->out_base + cap;
 }
 
-static void um_32_spin_cycle(void)
+// Releases the exhausted input span and asks for the next one, making
+// sure any prompt written so far has gone out first.
+static int um_32_next_input_span(Machine *vm)
 {
-    while (!halted) {
-        if (PC >= M[0].len) {
-            EXCEPTION(0);
+    if (vm->in_base) {
+        vm->io.in_consume(vm->io.ctx, vm->in_ptr - vm->in_base);
+        vm->in_base = vm->in_ptr = vm->in_end = NULL;
+    }
+    um_32_flush_output(vm);
+    const uint8_t *data;
+    size_t len = 0;
+    UM_32_PROBE(input_block);
+    int status = vm->io.in_span(vm->io.ctx, &data, &len);
+    UM_32_PROBE2(input_unblock, status, status == IO_OK ? len : 0);
+    if (status == IO_OK) {
+        vm->in_base = vm->in_ptr = data;
+        vm->in_end = data + len;
+    }
+    return status;
+}
+
+// Settles the machine's spans with its backend, e.g. before the backend
+// is swapped out or closed.
+static void um_32_release_io(Machine *vm)
+{
+    um_32_flush_output(vm);
+    if (vm->in_base) {
+        vm->io.in_consume(vm->io.ctx, vm->in_ptr - vm->in_base);
+        vm->in_base = vm->in_ptr = vm->in_end = NULL;
+    }
+}
+
+// Set from signal handlers, or by ALLOC when it is time to compact, to make
+// the interpreter call um_32_service at its next safe point (an
+// instruction boundary at LOAD_PROG or INPUT).
+volatile sig_atomic_t um_32_attention;
+static volatile sig_atomic_t snapshot_requested;
+static volatile sig_atomic_t migrate_requested;
+static volatile sig_atomic_t chill_requested;
+
+void um_32_request_snapshot(int sig)
+{
+    snapshot_requested = 1;
+    um_32_attention = 1;
+}
+
+void um_32_request_migrate(int sig)
+{
+    migrate_requested = 1;
+    um_32_attention = 1;
+}
+
+void um_32_request_chill(int sig)
+{
+    chill_requested = 1;
+    um_32_attention = 1;
+}
+
+// Returns true if um_32_run should stop here, so the caller can do what
+// can't be done from inside it.
+static bool um_32_service(Machine *vm)
+{
+    um_32_attention = 0;
+    if (snapshot_requested) {
+        snapshot_requested = 0;
+        if (vm->snapshot_path && !um_32_snapshot_save(vm, vm->snapshot_path)) {
+            perror("writing snapshot");
+        }
+    }
+    if (chill_requested) {
+        chill_requested = 0;
+        if (vm->cold) {
+            um_32_chill(vm);
+        }
+    }
+    if (vm->compact_ratio && vm->region.held > vm->compact_at && !vm->siblings) {
+        um_32_compact(vm);
+    }
+    if (vm->siblings) {
+        um_32_siblings_quiesce(vm);
+    }
+    return migrate_requested && vm->migrate_path;
+}
+
+#define CUR_INST(vm) (vm->M[0].inst[vm->PC - 1])
+
+// Only for use inside um_32_run: the faulting instruction is not retired.
+#define EXCEPTION(vm, inst) { \
+    vm->icount += start - budget; \
+    vm->fault_inst = inst; \
+    UM_32_PROBE2(exception, vm->PC - 1, inst); \
+    um_32_flush_output(vm); \
+    return RUN_FAILED; \
+}
+
+void um_32_print_fault(Machine *vm)
+{
+    um_32_print_debug_inst(vm->fault_inst);
+    um_32_print_debug_state(vm);
+}
+
+static inline uint32_t um_32_alloc_array(Machine *vm, uint32_t len)
+{
+    if (vm->memarr_count == vm->memarr_cap) {
+        um_32_grow_table(vm);
+    }
+    vm->memarr_count += 1;
+    uint32_t idx = vm->memarr_count - 1;
+    vm->M[idx].inst = region_calloc(&vm->region, len * 4);
+    vm->M[idx].len = len;
+    vm->M[idx].active = true;
+    if (vm->dirty) {
+        vm->dirty[idx] = 1;
+    }
+    if (vm->cold && len * 4 > REGION_LARGE_SIZE) {
+        um_32_cold_track(vm, idx);
+    }
+    if (vm->compact_ratio && vm->region.held > vm->compact_at) {
+        um_32_attention = 1;
+    }
+    UM_32_PROBE2(alloc, idx, len);
+    return idx;
+}
+
+// Single operations for engines that keep a machine's registers and
+// finger elsewhere (um-32-lockstep.c). Operands must have been checked.
+uint32_t um_32_op_alloc(Machine *vm, uint32_t len)
+{
+    return um_32_alloc_array(vm, len);
+}
+
+void um_32_op_abandon(Machine *vm, uint32_t idx)
+{
+    UM_32_PROBE2(abandon, idx, vm->M[idx].len);
+    vm->M[idx].active = false;
+    region_free(&vm->region, vm->M[idx].inst, vm->M[idx].len * 4);
+}
+
+void um_32_op_output(Machine *vm, uint32_t c)
+{
+    if (vm->out_ptr == vm->out_end) {
+        um_32_next_output_span(vm);
+    }
+    *vm->out_ptr++ = c;
+    if (vm->io.line_flush && c == '\n') {
+        um_32_flush_output(vm);
+    }
+}
+
+// Returns IO_AGAIN, leaving `*c` alone, if no input is to be had yet.
+int um_32_op_input(Machine *vm, uint32_t *c)
+{
+    if (vm->in_ptr == vm->in_end) {
+        int status = um_32_next_input_span(vm);
+        if (status == IO_AGAIN) {
+            return IO_AGAIN;
+        }
+        if (status == IO_EOF) {
+            *c = 0xffffffff;
+            return IO_EOF;
+        }
+    }
+    *c = *vm->in_ptr++;
+    return IO_OK;
+}
+
+static void um_32_load_program(Machine *vm, uint32_t idx)
+{
+    um_32_warm(vm, idx);
+    Mem src = vm->M[idx];
+#if 0
+    fprintf(stderr, "** LOADING PROGRAM %d (%ld bytes)\n", idx, src.len * 4);
+#endif
+    Mem dest = {0};
+    dest.inst = um_32_alloc_program(vm, src.len);
+    memcpy(dest.inst, src.inst, src.len * 4);
+    dest.len = src.len;
+    dest.active = true;
+    um_32_decoder_cancel(vm);
+    Mem old = vm->M[0];
+    vm->M[0] = dest;
+    region_free(&vm->region, old.inst, (old.len + 1) * 4);
+    um_32_predecode(vm);
+    if (vm->dirty) {
+        vm->dirty[0] = 1;
+    }
+}
+
+// At the first EXT_SPAWN, hands array 0, the array table and the console
+// over to be shared with siblings. Array 0 is decoded once for all of
+// them, so it must be decoded now.
+static void um_32_share(Machine *vm)
+{
+    um_32_decode_now(vm);
+    um_32_cold_stop(vm);
+    um_32_release_io(vm);
+    vm->nested = false;
+    um_32_siblings_start(vm);
+}
+
+// Runs the guest of um.um directly from the interpreter's dispatch point,
+// against the interpreter's own representation: registers in words 0-7,
+// array 0 at word 256, other arrays behind a length word. Each guest
+// instruction counts as one against `budget`, of which at least one is
+// left for the caller. Anything out of the ordinary (a guest Fail or HALT,
+// blocked input, a write over the interpreter, a pending snapshot) is
+// handed back to um.um itself: the guest's state is written back and the
+// host resumes at the dispatch point, where the interpreter runs that one
+// instruction the slow way. Returns what is left of the budget.
+static uint64_t um_32_nested_run(Machine *vm, uint64_t budget)
+{
+    uint32_t *m0 = vm->M[0].inst;
+    uint32_t r[NESTED_REGS];
+    memcpy(r, m0, sizeof(r));
+    uint32_t pc = vm->R[0] - NESTED_IMAGE_LEN;
+    for (; budget > 1; budget--) {
+        uint32_t at = pc + NESTED_IMAGE_LEN;
+        if (at < NESTED_IMAGE_LEN || at >= vm->M[0].len) {
+            break;
+        }
+        uint32_t inst = m0[at];
+        uint32_t reg_a = (inst >> 6) & 0x7;
+        uint32_t reg_b = (inst >> 3) & 0x7;
+        uint32_t reg_c = (inst >> 0) & 0x7;
+        uint32_t next = pc + 1;
+        switch (inst >> 28) {
+            case CMOV:
+                if (r[reg_c] != 0) {
+                    r[reg_a] = r[reg_b];
+                }
+                break;
+            case ARRAY_INDEX:
+                {
+                    uint32_t idx = r[reg_b];
+                    if (idx == 0) {
+                        uint32_t off = r[reg_c] + NESTED_IMAGE_LEN;
+                        if (off < NESTED_IMAGE_LEN) {
+                            goto out;
+                        }
+                        r[reg_a] = m0[off];
+                        break;
+                    }
+                    if (idx >= vm->memarr_count || !vm->M[idx].active) {
+                        goto out;
+                    }
+                    r[reg_a] = vm->M[idx].inst[(uint32_t)(r[reg_c] + 1)];
+                }
+                break;
+            case ARRAY_AMEND:
+                {
+                    uint32_t idx = r[reg_a];
+                    if (idx == 0) {
+                        uint32_t off = r[reg_b] + NESTED_IMAGE_LEN;
+                        if (off < NESTED_IMAGE_LEN) {
+                            goto out;
+                        }
+                        m0[off] = r[reg_c];
+                        um_32_amend_code(vm, off);
+                        if (vm->dirty) {
+                            vm->dirty[0] = 1;
+                        }
+                        break;
+                    }
+                    if (idx >= vm->memarr_count || !vm->M[idx].active) {
+                        goto out;
+                    }
+                    vm->M[idx].inst[(uint32_t)(r[reg_b] + 1)] = r[reg_c];
+                    if (vm->dirty) {
+                        vm->dirty[idx] = 1;
+                    }
+                }
+                break;
+            case ADD:
+                r[reg_a] = r[reg_b] + r[reg_c];
+                break;
+            case MUL:
+                r[reg_a] = r[reg_b] * r[reg_c];
+                break;
+            case DIV:
+                if (r[reg_c] == 0) {
+                    goto out;
+                }
+                r[reg_a] = r[reg_b] / r[reg_c];
+                break;
+            case NAND:
+                r[reg_a] = ~(r[reg_b] & r[reg_c]);
+                break;
+            case ALLOC:
+                {
+                    uint32_t len = r[reg_c];
+                    if (len == UINT32_MAX) {
+                        goto out;
+                    }
+                    uint32_t idx = um_32_alloc_array(vm, len + 1);
+                    vm->M[idx].inst[0] = len;
+                    r[reg_b] = idx;
+                }
+                break;
+            case ABANDON:
+                {
+                    uint32_t idx = r[reg_c];
+                    if (idx == 0 || idx >= vm->memarr_count || !vm->M[idx].active) {
+                        goto out;
+                    }
+                    UM_32_PROBE2(abandon, idx, vm->M[idx].len);
+                    vm->M[idx].active = false;
+                    region_free(&vm->region, vm->M[idx].inst, vm->M[idx].len * 4);
+                }
+                break;
+            case OUTPUT:
+                if (vm->out_ptr == vm->out_end) {
+                    um_32_next_output_span(vm);
+                }
+                *vm->out_ptr++ = r[reg_c];
+                if (vm->io.line_flush && r[reg_c] == '\n') {
+                    um_32_flush_output(vm);
+                }
+                break;
+            case INPUT:
+                if (um_32_attention) {
+                    goto out;
+                }
+                if (vm->in_ptr == vm->in_end) {
+                    int status = um_32_next_input_span(vm);
+                    if (status == IO_AGAIN) {
+                        goto out;
+                    }
+                    if (status == IO_EOF) {
+                        r[reg_c] = 0xffffffff;
+                        break;
+                    }
+                }
+                r[reg_c] = *vm->in_ptr++;
+                break;
+            case LOAD_PROG:
+                {
+                    uint32_t idx = r[reg_b];
+                    if (idx != 0) {
+                        if (idx >= vm->memarr_count || !vm->M[idx].active ||
+                            vm->M[idx].inst[0] >= vm->M[idx].len) {
+                            goto out;
+                        }
+                        // As um.um does it: build interpreter plus program in
+                        // a fresh array (which stays allocated) and load that.
+                        uint32_t len = vm->M[idx].inst[0];
+                        memcpy(m0, r, sizeof(r));
+                        uint32_t tmp = um_32_alloc_array(vm, len + NESTED_IMAGE_LEN);
+                        memcpy(vm->M[tmp].inst, m0, NESTED_IMAGE_LEN * 4);
+                        memcpy(vm->M[tmp].inst + NESTED_IMAGE_LEN, vm->M[idx].inst + 1, len * 4);
+                        um_32_load_program(vm, tmp);
+                        m0 = vm->M[0].inst;
+                    }
+                    next = r[reg_c];
+                    UM_32_PROBE3(load_prog, idx, pc, next);
+                    if (um_32_attention) {
+                        pc = next;
+                        budget--;
+                        goto out;
+                    }
+                }
+                break;
+            case ORTHOG:
+                r[(inst >> 25) & 0x7] = inst & 0x1ffffff;
+                break;
+            default:
+                goto out;
+        }
+        pc = next;
+    }
+out:
+    memcpy(m0, r, sizeof(r));
+    vm->R[0] = pc + NESTED_IMAGE_LEN;
+    vm->R[2] = 7;
+    vm->R[5] = NESTED_DISPATCH;
+    vm->R[6] = 0;
+    vm->PC = NESTED_DISPATCH;
+    return budget;
+}
+
+// Runs the machine for at most `budget` instructions. A machine whose
+// backend has no input ready stops at (and will retry) its INPUT; a machine
+// that Fails stops with its debug state intact for um_32_print_fault.
+// Retired instructions are added to vm->icount on the way out, so the loop
+// itself pays only for the budget countdown it already does.
+RunStatus um_32_run(Machine *vm, uint64_t budget)
+{
+    if (vm->halted) {
+        return RUN_HALTED;
+    }
+    const uint64_t start = budget;
+    for (; budget; budget--) {
+        // FETCH AND DECODE INSTRUCTION
+        // Siblings share array 0, its decoded form, and every other array,
+        // so those are read and written with relaxed atomics (plain loads
+        // and stores on the machines we build for).
+        Decoded d;
+        if (vm->code) {
+            __atomic_load(&vm->code[vm->PC], &d, __ATOMIC_RELAXED);
+        } else {
+            d = um_32_decode(vm->M[0].inst[vm->PC]);
         }
-        // FETCH INSTRUCTION
-        uint32_t inst = M[0].inst[PC];
 #ifdef DEBUG
-        um_32_print_debug_inst(inst);
-        um_32_print_debug_state();
+        um_32_print_debug_inst(vm->M[0].inst[vm->PC]);
+        um_32_print_debug_state(vm);
 #endif
         // ADVANCE PC
-        PC += 1;
-        // DECODE INSTRUCTION
-        uint32_t opnum = (inst >> 28) & 0xf;
-        uint32_t reg_a = (inst >>  6) & 0x7;
-        uint32_t reg_b = (inst >>  3) & 0x7;
-        uint32_t reg_c = (inst >>  0) & 0x7;
-        // DISPATCH INSTRUCTION
-        switch (opnum) {
+        vm->PC += 1;
+        uint32_t reg_a = d.a;
+        uint32_t reg_b = d.b;
+        uint32_t reg_c = d.c;
+        // DISPATCH INSTRUCTION (every opcode has a case, so the mask lets
+        // the compiler drop the jump table's range check)
+        switch (d.op & 0xf) {
             case CMOV:
-                if (R[reg_c] != 0) {
-                    R[reg_a] = R[reg_b];
+                if (vm->R[reg_c] != 0) {
+                    vm->R[reg_a] = vm->R[reg_b];
                 }
                 break;
             case ARRAY_INDEX:
                 {
-                    uint32_t idx = R[reg_b];
-                    if (!M[idx].active || idx > (memarr_count - 1)) {
-                        EXCEPTION(inst);
+                    uint32_t idx = vm->R[reg_b];
+                    if (!__atomic_load_n(&vm->M[idx].active, __ATOMIC_RELAXED) ||
+                        idx > (vm->memarr_count - 1)) {
+                        // A sweep may have taken it (or be keeping it as
+                        // bytes), or a sibling allocated it since.
+                        if (vm->cold && um_32_bytes_index(vm, idx, vm->R[reg_c], &vm->R[reg_a])) {
+                            break;
+                        }
+                        if (!um_32_warm(vm, idx) &&
+                            (!vm->siblings || !um_32_siblings_refresh(vm, idx))) {
+                            EXCEPTION(vm, CUR_INST(vm));
+                        }
                     }
-                    uint32_t off = R[reg_c];
-                    R[reg_a] = M[idx].inst[off];
+                    uint32_t off = vm->R[reg_c];
+                    vm->R[reg_a] = __atomic_load_n(&vm->M[idx].inst[off], __ATOMIC_RELAXED);
                 }
                 break;
             case ARRAY_AMEND:
                 {
-                    uint32_t idx = R[reg_a];
-                    if (!M[idx].active || idx > (memarr_count - 1)) {
-                        EXCEPTION(inst);
+                    uint32_t idx = vm->R[reg_a];
+                    if (!__atomic_load_n(&vm->M[idx].active, __ATOMIC_RELAXED) ||
+                        idx > (vm->memarr_count - 1)) {
+                        // A value too wide for a byte array widens it.
+                        if (vm->cold && um_32_bytes_amend(vm, idx, vm->R[reg_b], vm->R[reg_c])) {
+                            break;
+                        }
+                        if (!um_32_warm(vm, idx) &&
+                            (!vm->siblings || !um_32_siblings_refresh(vm, idx))) {
+                            EXCEPTION(vm, CUR_INST(vm));
+                        }
+                    }
+                    uint32_t off = vm->R[reg_b];
+                    __atomic_store_n(&vm->M[idx].inst[off], vm->R[reg_c], __ATOMIC_RELAXED);
+                    if (idx == 0) {
+                        um_32_amend_code(vm, off);
+                    }
+                    if (vm->dirty) {
+                        vm->dirty[idx] = 1;
                     }
-                    uint32_t off = R[reg_b];
-                    M[idx].inst[off] = R[reg_c];
                 }
                 break;
             case ADD:
-                R[reg_a] = R[reg_b] + R[reg_c];
+                vm->R[reg_a] = vm->R[reg_b] + vm->R[reg_c];
                 break;
             case MUL:
-                R[reg_a] = R[reg_b] * R[reg_c];
+                vm->R[reg_a] = vm->R[reg_b] * vm->R[reg_c];
                 break;
             case DIV:
-                R[reg_a] = R[reg_b] / R[reg_c];
+                vm->R[reg_a] = vm->R[reg_b] / vm->R[reg_c];
                 break;
             case NAND:
-                R[reg_a] = ~(R[reg_b] & R[reg_c]);
+                vm->R[reg_a] = ~(vm->R[reg_b] & vm->R[reg_c]);
                 break;
             case HALT:
-                halted = true;
-                break;
+                vm->halted = true;
+                vm->icount += start - budget + 1;
+                UM_32_PROBE2(halt, vm->PC - 1, vm->icount);
+                um_32_release_io(vm);
+#if 0
+                fprintf(stderr, "\n** Program halted.\n");
+#endif
+                return RUN_HALTED;
             case ALLOC:
-                {
-                    memarr_count += 1;
-                    uint32_t idx = memarr_count - 1;
-                    M = xrealloc(M, sizeof(Mem) * memarr_count);
-                    M[idx].inst = xcalloc(1, R[reg_c] * 4);
-                    M[idx].len = R[reg_c];
-                    M[idx].active = true;
-                    R[reg_b] = idx;
+                if (vm->siblings) {
+                    vm->R[reg_b] = um_32_siblings_alloc(vm, vm->R[reg_c]);
+                    break;
                 }
+                vm->R[reg_b] = um_32_alloc_array(vm, vm->R[reg_c]);
                 break;
             case ABANDON:
                 {
-                    uint32_t idx = R[reg_c];
-                    if (idx == 0 || !M[idx].active) {
-                        EXCEPTION(inst);
+                    uint32_t idx = vm->R[reg_c];
+                    if (vm->siblings) {
+                        if (!um_32_siblings_abandon(vm, idx)) {
+                            EXCEPTION(vm, CUR_INST(vm));
+                        }
+                        break;
                     }
-                    M[idx].active = false;
+                    if (idx == 0 || idx >= vm->memarr_count ||
+                        (!vm->M[idx].active && !um_32_warm(vm, idx))) {
+                        EXCEPTION(vm, CUR_INST(vm));
+                    }
+                    UM_32_PROBE2(abandon, idx, vm->M[idx].len);
+                    vm->M[idx].active = false;
+                    region_free(&vm->region, vm->M[idx].inst, vm->M[idx].len * 4);
                 }
                 break;
             case OUTPUT:
-                putchar(R[reg_c]);
+                if (vm->out_ptr == vm->out_end) {
+                    um_32_next_output_span(vm);
+                }
+                *vm->out_ptr++ = vm->R[reg_c];
+                if (vm->io.line_flush && vm->R[reg_c] == '\n') {
+                    um_32_flush_output(vm);
+                }
                 break;
             case INPUT:
                 {
-                    int c = getchar();
-                    if (c != EOF) {
-                        R[reg_c] = (uint8_t)c;
-                    } else {
-                        R[reg_c] = 0xffffffff;
+                    if (um_32_attention) {
+                        vm->PC -= 1;
+                        if (um_32_service(vm)) {
+                            vm->icount += start - budget;
+                            return RUN_YIELDED;
+                        }
+                        vm->PC += 1;
+                    }
+                    if (vm->in_ptr == vm->in_end) {
+                        int status = um_32_next_input_span(vm);
+                        if (status == IO_AGAIN) {
+                            vm->PC -= 1;
+                            vm->icount += start - budget;
+                            return RUN_BLOCKED;
+                        }
+                        if (status == IO_EOF) {
+                            vm->R[reg_c] = 0xffffffff;
+                            break;
+                        }
                     }
+                    vm->R[reg_c] = *vm->in_ptr++;
                 }
                 break;
             case LOAD_PROG:
                 {
-                    uint32_t idx = R[reg_b];
+                    uint32_t idx = vm->R[reg_b];
+                    uint32_t from = vm->PC - 1;
                     if (idx != 0) {
-                        Mem src = M[idx];
-#if 0
-                        fprintf(stderr, "** LOADING PROGRAM %d (%ld bytes)\n", idx, src.len * 4);
-#endif
-                        Mem dest = {0};
-                        dest.inst = xmalloc(src.len * 4);
-                        memcpy(dest.inst, src.inst, src.len * 4);
-                        dest.len = src.len;
-                        dest.active = true;
-                        Mem old = M[0];
-                        M[0] = dest;
-                        free_mem(old);
+                        // Siblings are all running the array 0 they share.
+                        if (vm->siblings) {
+                            EXCEPTION(vm, CUR_INST(vm));
+                        }
+                        um_32_load_program(vm, idx);
+                    } else if (vm->pending) {
+                        um_32_adopt_code(vm);
+                    }
+                    vm->PC = vm->R[reg_c];
+                    // The only way to aim the finger past the sentinel.
+                    if (vm->PC > vm->M[0].len) {
+                        EXCEPTION(vm, 0);
+                    }
+                    if (vm->edges) {
+                        um_32_edge(vm->edges, from, vm->PC, idx != 0);
+                    }
+                    if (vm->cov) {
+                        uint32_t cur = (vm->PC * 0x9e3779b1u) >> 16;
+                        vm->cov[cur ^ vm->cov_prev]++;
+                        vm->cov_prev = cur >> 1;
+                    }
+                    UM_32_PROBE3(load_prog, idx, from, vm->PC);
+                    if (um_32_attention && um_32_service(vm)) {
+                        vm->icount += start - budget + 1;
+                        return RUN_YIELDED;
+                    }
+                    // The fast path for um.um would keep its jumps from
+                    // the profile and the coverage map.
+                    if (vm->nested && !vm->edges && !vm->cov && vm->PC == NESTED_DISPATCH && vm->R[2] == 7 &&
+                        vm->R[5] == NESTED_DISPATCH && vm->R[6] == 0) {
+                        budget = um_32_nested_run(vm, budget);
                     }
-                    PC = R[reg_c];
                 }
                 break;
             case ORTHOG:
-                {
-                    uint8_t reg_a = (inst >> 25) & 0x7;
-                    uint32_t val = inst & 0x1ffffff;
-                    R[reg_a] = val;
+                vm->R[reg_a] = d.val;
+                break;
+            case EXT:
+                if (!vm->ext) {
+                    EXCEPTION(vm, CUR_INST(vm));
+                }
+                switch (d.val) {
+                    case EXT_SPAWN:
+                        {
+                            if (!vm->siblings) {
+                                um_32_share(vm);
+                            }
+                            uint32_t handle;
+                            if (!um_32_spawn(vm, vm->R[reg_c], reg_a, &handle)) {
+                                EXCEPTION(vm, CUR_INST(vm));
+                            }
+                            vm->R[reg_a] = handle;
+                        }
+                        break;
+                    case EXT_JOIN:
+                        {
+                            uint32_t result;
+                            if (!vm->siblings || !um_32_join(vm, vm->R[reg_c], reg_a, &result)) {
+                                EXCEPTION(vm, CUR_INST(vm));
+                            }
+                            vm->R[reg_a] = result;
+                            if (um_32_siblings_end(vm)) {
+                                vm->nested = um_32_nested_image(vm->M[0].inst, vm->M[0].len);
+                            }
+                        }
+                        break;
+                    case EXT_ICOUNT:
+                        {
+                            // Counted the same way whatever the budget, so
+                            // a guest sees the same values on every run.
+                            uint64_t n = vm->icount + (start - budget);
+                            vm->R[reg_a] = n >> 32;
+                            vm->R[reg_b] = n;
+                        }
+                        break;
+                    case EXT_CLOCK:
+                        {
+                            struct timespec ts;
+                            clock_gettime(CLOCK_MONOTONIC, &ts);
+                            uint64_t us = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+                            vm->R[reg_a] = us >> 32;
+                            vm->R[reg_b] = us;
+                        }
+                        break;
+                    default:
+                        EXCEPTION(vm, CUR_INST(vm));
                 }
                 break;
-            default:
-                EXCEPTION(inst);
+            case 15:
+                EXCEPTION(vm, CUR_INST(vm));
         }
     }
-#if 0
-    fprintf(stderr, "\n** Program halted.\n");
-#endif
+    vm->icount += start;
+    return RUN_YIELDED;
 }
 
-static void um_32_shutdown(void)
+MachineDescriptor um_32_descriptor = {
+    UM_32_DESCRIPTOR_MAGIC,
+    UM_32_DESCRIPTOR_VERSION,
+    NULL,
+    offsetof(Machine, PC),
+    offsetof(Machine, R),
+    offsetof(Machine, M),
+    offsetof(Machine, memarr_count),
+    sizeof(Mem),
+    offsetof(Mem, inst),
+    offsetof(Mem, len),
+    0,
+};
+
+// Runs a console machine until it halts, failing hard if it Fails, and
+// migrates it away if asked to.
+void um_32_spin_cycle(Machine *vm)
 {
-    while (memarr_count--) {
-        free_mem(M[memarr_count]);
+    RunStatus status;
+    um_32_descriptor.vm = vm;
+    while ((status = um_32_run(vm, UINT64_MAX)) != RUN_HALTED) {
+        if (status == RUN_FAILED) {
+            um_32_print_fault(vm);
+            assert(false);
+        }
+        if (migrate_requested) {
+            migrate_requested = 0;
+            um_32_attention = 0;
+            if (um_32_migrate_out(vm, vm->migrate_path, &status)) {
+                // The machine, and the console, live on elsewhere.
+                exit(0);
+            }
+            perror("migrating");
+            if (status == RUN_HALTED) {
+                break;
+            }
+            if (status == RUN_FAILED) {
+                um_32_print_fault(vm);
+                assert(false);
+            }
+        }
     }
+    um_32_descriptor.vm = NULL;
 }
 
-void usage()
+void um_32_shutdown(Machine *vm)
 {
-    fprintf(stderr, "Usage: %s program\n", program_invocation_name);
-    exit(1);
+    um_32_siblings_stop(vm);
+    um_32_decoder_cancel(vm);
+    um_32_cold_free(vm);
+    region_release(&vm->region);
+    vm->M = NULL;
+    vm->memarr_count = 0;
+    vm->memarr_cap = 0;
 }
 
 Buffer read_entire_file(FILE *f)
@@ -314,28 +1403,3 @@ Buffer read_entire_file(FILE *f)
     }
     return buf;
 }
-
-int main(int argc, char **argv)
-{
-    if (argc != 2) {
-        usage();
-    }
-
-    FILE *f = fopen(argv[1], "r");
-    if (!f) {
-        perror("opening program file");
-        return 1;
-    }
-    Buffer prog = read_entire_file(f);
-    fclose(f);
-
-    um_32_init(prog);
-#if 0
-    fprintf(stderr, "** UM-32 initialized, program %lu bytes.\n", prog.len);
-#endif
-    free_buffer(prog);
-    um_32_spin_cycle();
-    um_32_shutdown();
-
-    return 0;
-}
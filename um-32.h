@@ -0,0 +1,428 @@
+#ifndef UM_32_H
+#define UM_32_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+// For um-32.hpp: std::atomic<bool> has the layout of C's atomic_bool.
+#include <atomic>
+using std::atomic_bool;
+extern "C" {
+#else
+#include <stdalign.h>
+#include <stdatomic.h>
+#endif
+
+typedef struct Buffer {
+    uint8_t *data;
+    size_t len;
+} Buffer;
+
+typedef struct Mem {
+    uint32_t *inst;
+    size_t len;
+    bool active;
+} Mem;
+
+// Region allocator. Every byte a machine owns (the array table and all
+// array payloads) is carved from its region, so tearing a machine down or
+// resetting it for the next job is a walk over a handful of chunks rather
+// than over every array the guest ever allocated. Small allocations are
+// bump-allocated from shared chunks and only reclaimed wholesale; large
+// ones get a chunk of their own so they can be returned early.
+#define REGION_CHUNK_SIZE  (1 << 20)
+#define REGION_LARGE_SIZE  (REGION_CHUNK_SIZE / 4)
+
+typedef struct Chunk {
+    struct Chunk *prev;
+    struct Chunk *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} Chunk;
+
+typedef struct Region {
+    Chunk *first;   // small chunks, kept across resets
+    Chunk *cur;     // small chunk currently being bumped
+    Chunk *large;   // one chunk per large allocation
+    size_t held;    // bytes in all chunks, in use or not
+} Region;
+
+// Array 0 is always followed by this platter (an invalid instruction),
+// so running off its end traps like any other invalid instruction.
+#define TRAP_SENTINEL 0xffffffff
+
+// Pre-decoded form of an array 0 instruction. For ORTHOG, `a` is the
+// special register and `val` the immediate; for EXT, `val` is the
+// sub-operation. Aligned so that siblings, which share the decoded array
+// 0, can load and store one whole with a single relaxed atomic access.
+typedef struct Decoded {
+    alignas(8) uint8_t op;
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+    uint32_t val;
+} Decoded;
+
+// Programs at least this many platters long are decoded on the helper
+// thread; anything smaller is cheaper to decode on the spot.
+#define DECODE_ASYNC_MIN   (1 << 16)
+#define DECODE_AMEND_LOG   64
+
+// A decode job: the helper thread builds the decoded form of a freshly
+// loaded array 0 while the interpreter keeps running in the plain path.
+// One helper serves every machine in the process, taking jobs in the order
+// they were submitted. The job fields are guarded by the helper's lock;
+// `submitted`, the amend log and the generation belong to the interpreter
+// thread and record ARRAY_AMENDs to array 0 made while the job was in
+// flight, so they can be replayed onto the result before it is switched in.
+typedef struct Decoder {
+    struct Decoder *next;
+    bool submitted;
+    bool queued;
+    bool busy;
+    const uint32_t *src;
+    Decoded *out;
+    size_t len;
+    atomic_bool cancel;
+    atomic_bool ready;
+    uint32_t gen;
+    uint32_t amend_log[DECODE_AMEND_LOG];
+} Decoder;
+
+// Console I/O backend. Rather than moving one byte per call, the machine
+// writes OUTPUT into spans the backend lends it and reads INPUT out of
+// spans the backend supplies, so the per-byte cost is a pointer bump and
+// the backend decides where the bytes live.
+typedef enum IoStatus {
+    IO_OK,
+    IO_EOF,
+    IO_AGAIN,   // nothing to read right now; the machine will yield
+} IoStatus;
+
+typedef struct IoBackend {
+    void *ctx;
+    // Lends a writable span of `*cap` (> 0) bytes...
+    uint8_t *(*out_span)(void *ctx, size_t *cap);
+    // ...of which the first `n` bytes are now output.
+    void (*out_commit)(void *ctx, size_t n);
+    // Supplies `*len` (> 0) bytes of input, waiting for them if need be
+    // or returning IO_AGAIN if the backend is non-blocking...
+    int (*in_span)(void *ctx, const uint8_t **data, size_t *len);
+    // ...of which the first `n` bytes have been read.
+    void (*in_consume)(void *ctx, size_t n);
+    void (*destroy)(void *ctx);
+    bool line_flush;        // commit output at every newline
+} IoBackend;
+
+// Host-owned buffers for um_32_io_memory. With `out_grow` set the output
+// buffer is grown with xrealloc; otherwise output beyond `out_cap` is
+// dropped and `overflow` set.
+typedef struct MemIo {
+    const uint8_t *in;
+    size_t in_len;
+    size_t in_pos;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_cap;
+    bool out_grow;
+    bool overflow;
+    uint8_t scratch[256];
+} MemIo;
+
+// Host-owned state for um_32_io_capture: once `marker` has gone by in the
+// output, the rest is taken as a program image and assembled into
+// platters in `words` instead of being passed on.
+typedef struct Capture {
+    const char *marker;
+    bool active;            // the marker has been seen
+    uint32_t *words;
+    size_t len;
+    size_t cap;
+    uint32_t partial;       // bytes of a platter still being assembled
+    int npartial;
+} Capture;
+
+// Compaction: once a machine's region holds `compact_ratio` times what
+// was live after the last compaction (and at least COMPACT_MIN_HELD), the
+// live arrays are moved into a fresh region at the next safe point.
+#define COMPACT_MIN_HELD (16 << 20)
+
+typedef struct CompactStats {
+    uint64_t runs;
+    double seconds;
+    size_t held_before;     // summed over all runs: region size before,
+    size_t held_after;      // after,
+    size_t live;            // and the bytes actually in use
+} CompactStats;
+
+// Cold arrays: with `cold` set, um_32_chill (called every so often)
+// compresses large arrays that went untouched since the sweep before, and
+// um_32_warm restores them at their next touch.
+typedef struct ColdStats {
+    uint64_t sweeps;
+    uint64_t packed;        // arrays compressed
+    uint64_t warmed;        // compressed arrays touched again
+    double seconds;         // spent sweeping and decompressing
+    size_t raw;             // bytes of the arrays compressed right now,
+    size_t comp;            // and what they take compressed
+    uint64_t narrowed;      // arrays stored as bytes
+    uint64_t widened;       // byte arrays given back their platters
+} ColdStats;
+
+typedef struct Cold {
+    uint8_t *state;         // per array
+    uint32_t *uses;         // per array stored as bytes, since the last sweep
+    uint32_t *large;        // arrays big enough to sweep (some of them
+    uint32_t nlarge;        // abandoned since)
+    uint32_t large_cap;
+} Cold;
+
+typedef struct EdgeProfile EdgeProfile;
+
+typedef enum RunStatus {
+    RUN_HALTED,
+    RUN_BLOCKED,    // waiting for input; run again once some arrives
+    RUN_YIELDED,    // instruction budget used up
+    RUN_FAILED,     // the machine Failed; see um_32_print_fault
+} RunStatus;
+
+// Machine state
+typedef struct Machine {
+    uint32_t PC;
+    uint32_t R[8];          // registers
+    Mem *M;                 // memory arrays
+    uint32_t memarr_count;
+    uint32_t memarr_cap;
+    bool halted;
+    uint32_t fault_inst;    // instruction that made the machine Fail
+    bool nested;            // array 0 is the um.um self-interpreter
+    bool ext;               // opcode 14 runs the EXT operations
+    struct Siblings *siblings;  // shared with siblings since EXT_SPAWN
+    uint64_t icount;        // instructions retired by um_32_run
+    Region region;
+    Decoded *code;          // decoded array 0, or NULL while not available
+    Decoded *pending;       // decoded array 0 being built by the decoder
+    Decoder decoder;
+    const char *snapshot_path;  // written on SIGUSR1, if set
+    const char *migrate_path;   // migrated to on SIGUSR2, if set
+    uint8_t *dirty;         // per array: written since the last pre-copy
+                            // round, while a migration is under way
+    uint32_t compact_ratio; // 0: never compact
+    size_t compact_at;      // region size that triggers the next compaction
+    CompactStats compact;
+    Cold *cold;             // if sweeps are on
+    EdgeProfile *edges;     // LOAD_PROG edges are counted here, if set
+    uint8_t *cov;           // AFL coverage map, if fuzzing
+    uint32_t cov_prev;      // hash of the last jump target, halved
+    ColdStats cold_stats;
+    IoBackend io;           // must be set before the machine runs
+    uint8_t *out_base;      // current output span
+    uint8_t *out_ptr;
+    uint8_t *out_end;
+    const uint8_t *in_base; // current input span
+    const uint8_t *in_ptr;
+    const uint8_t *in_end;
+} Machine;
+
+// How a tool outside the process (um-32-sample) finds the machine it is
+// running: it looks up this symbol in the executable and reads the rest
+// with process_vm_readv, going by the offsets rather than by a Machine
+// layout it may not share. Whatever runs a machine publishes it in `vm`
+// for as long as it runs it; modes that run several at once on separate
+// threads (pipelines, lockstep, threaded benchmarks) publish none and set
+// `many` instead.
+#define UM_32_DESCRIPTOR_MAGIC 0x32334d55   // "UM32"
+#define UM_32_DESCRIPTOR_VERSION 2
+
+typedef struct MachineDescriptor {
+    uint32_t magic;
+    uint32_t version;
+    Machine *volatile vm;   // the machine running, or NULL
+    uint32_t pc_offset;     // in Machine
+    uint32_t r_offset;
+    uint32_t m_offset;
+    uint32_t count_offset;
+    uint32_t mem_size;      // of a Mem
+    uint32_t inst_offset;   // in Mem
+    uint32_t len_offset;
+    volatile uint32_t many; // machines run side by side, none published
+} MachineDescriptor;
+
+extern MachineDescriptor um_32_descriptor;
+
+typedef enum Op {
+    CMOV,
+    ARRAY_INDEX,
+    ARRAY_AMEND,
+    ADD,
+    MUL,
+    DIV,
+    NAND,
+    HALT,
+    ALLOC,
+    ABANDON,
+    OUTPUT,
+    INPUT,
+    LOAD_PROG,
+    ORTHOG,
+
+    NUM_OPS,
+} Op;
+
+// Extension operations, enabled per machine with `ext`: opcode 14 with
+// the sub-operation in bits 9-27 and registers A, B and C where a
+// standard operator has them.
+#define EXT 14
+
+typedef enum ExtOp {
+    EXT_SPAWN,  // A := handle of a new sibling that starts at finger C,
+                // with this machine's registers but A := 0
+    EXT_JOIN,   // wait for sibling C to halt; A := its register A
+    EXT_ICOUNT, // A:B := instructions this machine retired before this one
+    EXT_CLOCK,  // A:B := host monotonic time in microseconds
+} ExtOp;
+
+extern const char *op_names[];
+
+extern volatile sig_atomic_t um_32_attention;
+
+void free_buffer(Buffer b);
+Buffer read_entire_file(FILE *f);
+
+bool write_all(int fd, const void *buf, size_t len);
+bool read_all(int fd, void *buf, size_t len);
+void *xmalloc(size_t size);
+void *xcalloc(size_t nmemb, size_t size);
+void *xrealloc(void *oldptr, size_t newsize);
+
+void *region_alloc(Region *r, size_t size);
+void *region_calloc(Region *r, size_t size);
+void region_free(Region *r, void *ptr, size_t size);
+void region_reset(Region *r);
+void region_release(Region *r);
+
+void um_32_init(Machine *vm, Buffer prog);
+void um_32_init_words(Machine *vm, const uint32_t *words, size_t len);
+void um_32_shutdown(Machine *vm);
+RunStatus um_32_run(Machine *vm, uint64_t budget);
+void um_32_print_fault(Machine *vm);
+uint32_t *um_32_alloc_program(Machine *vm, size_t len);
+Decoded um_32_decode(uint32_t inst);
+void um_32_predecode(Machine *vm);
+void um_32_quiesce(Machine *vm);
+void um_32_flush_output(Machine *vm);
+void um_32_reset(Machine *vm);
+void um_32_spin_cycle(Machine *vm);
+
+// Signal handlers asking a machine run by um_32_spin_cycle to write its
+// snapshot, migrate, or sweep for cold arrays at its next safe point.
+void um_32_request_snapshot(int sig);
+void um_32_request_migrate(int sig);
+void um_32_request_chill(int sig);
+uint32_t um_32_op_alloc(Machine *vm, uint32_t len);
+void um_32_op_abandon(Machine *vm, uint32_t idx);
+void um_32_op_output(Machine *vm, uint32_t c);
+int um_32_op_input(Machine *vm, uint32_t *c);
+
+// Console I/O backends (um-32-io.c).
+void um_32_io_fd(IoBackend *io, int in_fd, int out_fd);
+void um_32_io_socket(IoBackend *io, int sock);
+void um_32_io_stdio(IoBackend *io, FILE *in, FILE *out);
+void um_32_io_memory(IoBackend *io, MemIo *mem);
+void um_32_io_capture(IoBackend *io, IoBackend *inner, Capture *cap);
+bool um_32_io_fd_nonblock(IoBackend *io, bool on);
+bool um_32_io_fd_preload(IoBackend *io, const uint8_t *data, size_t len);
+void um_32_io_close(IoBackend *io);
+
+// Multi-session host (um-32-host.c). A tenant is a peer IP address or
+// "uid:N" for a Unix socket peer; tenants not listed have weight 1.
+typedef struct TenantWeight {
+    const char *tenant;
+    unsigned weight;
+} TenantWeight;
+
+int um_32_host(Buffer prog, const char *addr, bool force_epoll, unsigned cold_secs,
+               unsigned idle_secs, const TenantWeight *weights, int nweights);
+
+// In-process pipelines of machines (um-32-pipe.c).
+int um_32_pipeline(Buffer *progs, int n);
+
+// Sibling machines (um-32-sibling.c).
+void um_32_siblings_start(Machine *vm);
+bool um_32_spawn(Machine *vm, uint32_t pc, uint32_t reg, uint32_t *handle);
+bool um_32_join(Machine *vm, uint32_t handle, uint32_t reg, uint32_t *result);
+bool um_32_siblings_end(Machine *vm);
+void um_32_siblings_stop(Machine *vm);
+uint32_t um_32_siblings_alloc(Machine *vm, uint32_t len);
+bool um_32_siblings_abandon(Machine *vm, uint32_t idx);
+bool um_32_siblings_refresh(Machine *vm, uint32_t idx);
+void um_32_siblings_quiesce(Machine *vm);
+
+// Compression of cold arrays (um-32-cold.c).
+void um_32_cold_start(Machine *vm);
+void um_32_cold_stop(Machine *vm);
+void um_32_cold_free(Machine *vm);
+void um_32_cold_track(Machine *vm, uint32_t idx);
+void um_32_chill(Machine *vm);
+bool um_32_warm(Machine *vm, uint32_t idx);
+bool um_32_bytes_index(Machine *vm, uint32_t idx, uint32_t off, uint32_t *val);
+bool um_32_bytes_amend(Machine *vm, uint32_t idx, uint32_t off, uint32_t val);
+void um_32_warm_all(Machine *vm);
+size_t um_32_cold_size(Machine *vm, uint32_t idx);
+bool um_32_cold_apart(Machine *vm, uint32_t idx);
+void um_32_print_cold(const ColdStats *st);
+
+// Control-flow edge profile (um-32-edges.c).
+EdgeProfile *um_32_edges_new(void);
+void um_32_edges_free(EdgeProfile *p);
+void um_32_edge(EdgeProfile *p, uint32_t from, uint32_t to, bool load);
+bool um_32_edges_write(EdgeProfile *p, const char *path);
+
+// Coverage-guided fuzzing of guest input (um-32-fuzz.c).
+void um_32_fuzz_start(Machine *vm);
+void um_32_fuzz_stop(Machine *vm);
+void um_32_io_fuzz(IoBackend *io, IoBackend *inner, Machine *vm);
+
+// Many machines on one program in SIMD lanes (um-32-lockstep.c).
+int um_32_lockstep(Buffer prog, char **inputs, int n);
+
+// Live migration between processes (um-32-migrate.c).
+bool um_32_migrate_send(Machine *vm, int sock, int in_fd, int out_fd, RunStatus *status);
+bool um_32_migrate_recv(Machine *vm, int sock);
+bool um_32_migrate_out(Machine *vm, const char *path, RunStatus *status);
+bool um_32_migrate_in(Machine *vm, const char *path);
+
+// Multi-instance throughput benchmark (um-32-bench.c).
+int um_32_bench(Buffer prog, int max_instances, bool processes, uint64_t limit,
+                uint32_t compact_ratio);
+
+// Fast LZ-class block codec (um-32-lz.c).
+size_t lz_compress_bound(size_t len);
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+bool lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len);
+
+// Machine snapshots (um-32-snapshot.c).
+bool um_32_snapshot_write(Machine *vm, int fd);
+bool um_32_snapshot_read(Machine *vm, int fd);
+bool um_32_snapshot_save(Machine *vm, const char *path);
+bool um_32_snapshot_load(Machine *vm, const char *path);
+bool um_32_hibernate(Machine *vm, int fd);
+bool um_32_wake(Machine *vm, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
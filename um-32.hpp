@@ -0,0 +1,216 @@
+#ifndef UM_32_HPP
+#define UM_32_HPP
+
+// C++20 coroutine front end for embedding machines in an async host.
+//
+// um32::Machine::run() is a coroutine: it runs the machine a quantum at a
+// time and, between quanta, awaits whatever the host's `Io` hands back:
+//
+//     io.read()           -> awaitable of std::span<const uint8_t>;
+//                            the bytes the machine asked for, empty at EOF
+//     io.write(bytes)     -> awaitable; the machine's output since the
+//                            last write (the span lives until it resumes)
+//     io.yield()          -> awaitable; a quantum went by
+//
+// so an INPUT with nothing to read suspends the coroutine until the host
+// has bytes, and no thread ever blocks in the interpreter. One event loop
+// can drive as many machines as it likes:
+//
+//     um32::Task<RunStatus> session(um32::Machine &m, Conn &conn)
+//     {
+//         co_return co_await m.run(conn);
+//     }
+//
+// Everything underneath is um_32_run with an IoBackend that never waits:
+// it returns IO_AGAIN, which makes um_32_run stop with RUN_BLOCKED.
+//
+// The machine itself is the C library build.sh makes, libum-32.a (every
+// um-32*.c but um-32-main.c); link a host against it with -pthread:
+//
+//     c++ -std=c++20 -o host host.cpp libum-32.a -pthread
+
+#include "um-32.h"
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace um32 {
+
+// A lazily started coroutine returning T, resumed by whoever awaits it
+// (or by start(), at the top of a host's own scheduling).
+template <class T>
+class Task {
+public:
+    struct promise_type {
+        T value{};
+        std::exception_ptr error;
+        std::coroutine_handle<> next = std::noop_coroutine();
+
+        Task get_return_object()
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept
+        {
+            struct Final {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+                {
+                    return h.promise().next;
+                }
+                void await_resume() noexcept {}
+            };
+            return Final{};
+        }
+        void return_value(T v) { value = std::move(v); }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    Task(Task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other) {
+            destroy();
+            h_ = std::exchange(other.h_, {});
+        }
+        return *this;
+    }
+    ~Task() { destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) noexcept
+    {
+        h_.promise().next = waiter;
+        return h_;
+    }
+    T await_resume() { return result(); }
+
+    // For a host that isn't itself a coroutine: runs the task until its
+    // first suspension; the host's awaitables resume it from then on.
+    void start() { h_.resume(); }
+    bool done() const { return h_.done(); }
+    T result()
+    {
+        if (h_.promise().error) {
+            std::rethrow_exception(h_.promise().error);
+        }
+        return std::move(h_.promise().value);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+    void destroy()
+    {
+        if (h_) {
+            h_.destroy();
+        }
+    }
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+class Machine {
+public:
+    // Instructions between yields, as in the multi-session host.
+    static constexpr uint64_t kQuantum = 1 << 20;
+
+    explicit Machine(std::span<const uint8_t> program)
+    {
+        Buffer prog = {const_cast<uint8_t *>(program.data()), program.size()};
+        um_32_init(&vm_, prog);
+        vm_.io = IoBackend{};
+        vm_.io.ctx = this;
+        vm_.io.out_span = out_span;
+        vm_.io.out_commit = out_commit;
+        vm_.io.in_span = in_span;
+        vm_.io.in_consume = in_consume;
+    }
+    Machine(const Machine &) = delete;
+    Machine &operator=(const Machine &) = delete;
+    ~Machine() { um_32_shutdown(&vm_); }
+
+    // Runs the machine to its end: RUN_HALTED, or RUN_FAILED (see
+    // print_fault). Whatever it wrote is written to `io` first.
+    template <class Io>
+    Task<RunStatus> run(Io &io, uint64_t quantum = kQuantum)
+    {
+        for (;;) {
+            RunStatus status = um_32_run(&vm_, quantum);
+            um_32_flush_output(&vm_);
+            if (out_len_) {
+                std::span<const uint8_t> bytes(out_.data(), out_len_);
+                out_len_ = 0;
+                co_await io.write(bytes);
+            }
+            switch (status) {
+                case RUN_HALTED:
+                case RUN_FAILED:
+                    co_return status;
+                case RUN_BLOCKED:
+                    {
+                        std::span<const uint8_t> bytes = co_await io.read();
+                        // Copied, so the host's buffer is its own again.
+                        in_.assign(bytes.begin(), bytes.end());
+                        in_pos_ = 0;
+                        eof_ = bytes.empty();
+                    }
+                    break;
+                case RUN_YIELDED:
+                    co_await io.yield();
+                    break;
+            }
+        }
+    }
+
+    void print_fault() { um_32_print_fault(&vm_); }
+    uint64_t icount() const { return vm_.icount; }
+    ::Machine *get() { return &vm_; }
+
+private:
+    static uint8_t *out_span(void *ctx, size_t *cap)
+    {
+        Machine *m = static_cast<Machine *>(ctx);
+        if (m->out_len_ == m->out_.size()) {
+            m->out_.resize(m->out_.empty() ? 4096 : m->out_.size() * 2);
+        }
+        *cap = m->out_.size() - m->out_len_;
+        return m->out_.data() + m->out_len_;
+    }
+
+    static void out_commit(void *ctx, size_t n)
+    {
+        static_cast<Machine *>(ctx)->out_len_ += n;
+    }
+
+    static int in_span(void *ctx, const uint8_t **data, size_t *len)
+    {
+        Machine *m = static_cast<Machine *>(ctx);
+        if (m->in_pos_ < m->in_.size()) {
+            *data = m->in_.data() + m->in_pos_;
+            *len = m->in_.size() - m->in_pos_;
+            return IO_OK;
+        }
+        return m->eof_ ? IO_EOF : IO_AGAIN;
+    }
+
+    static void in_consume(void *ctx, size_t n)
+    {
+        static_cast<Machine *>(ctx)->in_pos_ += n;
+    }
+
+    ::Machine vm_{};
+    std::vector<uint8_t> out_;
+    size_t out_len_ = 0;
+    std::vector<uint8_t> in_;
+    size_t in_pos_ = 0;
+    bool eof_ = false;
+};
+
+} // namespace um32
+
+#endif